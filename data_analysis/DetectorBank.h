@@ -0,0 +1,219 @@
+/*
+ Bank of peak detectors with different parameters, run side by side on one signal.
+
+ A structure-of-arrays version of the lowPassFilter -> slopeSumFilter -> peakDetect
+ chain for parameter studies on the host. The filters have no free parameters, so
+ they run once and are shared; the peakDetect state machine runs for BANK_LANES
+ parameter sets at once in SIMD lanes (AVX2 when compiled with -mavx2, otherwise
+ SSE2, or plain C++ with -DDETECTOR_BANK_SCALAR). Each lane gives exactly the same
+ peaks as a peakDetect object configured with the lane's parameters.
+
+ Per-lane parameters: the threshold scale, refractory period and threshold reset
+ period of RuntimeConfig.h.
+*/
+
+#ifndef __DETECTORBANK__
+#define __DETECTORBANK__
+
+#include <stdint.h>
+
+#if !defined(DETECTOR_BANK_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#elif !defined(DETECTOR_BANK_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "PressurePeakDetect.h"
+
+const int BANK_LANES = 16; // multiple of 8 so that every instruction set divides it evenly
+
+struct detectorParams {
+    int thresholdScale;
+    int refractoryPeriod;
+    int thresholdResetPeriod;
+};
+
+class detectorBank {
+public:
+    detectorBank(const detectorParams* params, const int lanes) {
+        // unused lanes repeat the last parameter set, their peaks are masked off
+        for (int ii = 0; ii < BANK_LANES; ii++) {
+            const detectorParams& p = params[ii < lanes ? ii : lanes - 1];
+            thresholdScale[ii] = p.thresholdScale;
+            refractoryPeriod[ii] = p.refractoryPeriod;
+            thresholdResetPeriod[ii] = p.thresholdResetPeriod;
+            risingEdge[ii] = -1;
+            rpCounter[ii] = 0;
+            peakThreshold[ii] = 0;
+            peakSum[ii] = 0;
+            peakPos[ii] = 0;
+            for (int jj = 0; jj < PEAK_BUFFER_LEN; jj++) {
+                peakBuffer[jj][ii] = 0;
+            }
+        }
+        laneMask = lanes >= 32 ? 0xFFFFFFFF : (1u << lanes) - 1;
+        for (int ii = 0; ii < BUFFER_LEN; ii++) {
+            history[ii] = 0;
+        }
+    }
+
+    // filters one raw ADC sample and returns a bit mask of the lanes that found a peak
+    uint32_t step(const int sample) {
+        return isPeak(ssf.step(filt.step(sample)));
+    }
+
+    // same as step, for a slope sum sample that has already been filtered
+    uint32_t isPeak(const int x) {
+        // the rolling sums only depend on the shared slope sum signal, see peakDetect::isPeak
+        for (int ii = 0; ii < BUFFER_LEN - 1; ii++) {
+            history[ii] = history[ii + 1];
+        }
+        history[BUFFER_LEN - 1] = x;
+        int lrs = history[BUFFER_LEN - ROLLING_POINT_SPACING] + history[BUFFER_LEN - ROLLING_POINT_SPACING - 1];
+        int rrs = history[BUFFER_LEN - 1] + x;
+
+        uint32_t resets = 0;
+        uint32_t peaks = stepLanes(lrs, rrs, resets);
+
+        // threshold updates and resets are rare, and need a division, so they're done lane by lane
+        for (uint32_t mask = peaks; mask; mask &= mask - 1) {
+            updatePeakThreshold(ctz(mask), lrs);
+        }
+        for (uint32_t mask = resets; mask; mask &= mask - 1) {
+            resetPeakThreshold(ctz(mask));
+        }
+        return peaks & laneMask;
+    }
+
+private:
+    lowPassFilter filt;
+    slopeSumFilter ssf;
+    int history[BUFFER_LEN]; // slope sum samples, oldest first
+    uint32_t laneMask;
+
+    // one entry per lane, booleans are stored as 0 / -1 masks
+    alignas(32) int32_t thresholdScale[BANK_LANES];
+    alignas(32) int32_t refractoryPeriod[BANK_LANES];
+    alignas(32) int32_t thresholdResetPeriod[BANK_LANES];
+    alignas(32) int32_t risingEdge[BANK_LANES];
+    alignas(32) int32_t rpCounter[BANK_LANES];
+    alignas(32) int32_t peakThreshold[BANK_LANES];
+    int32_t peakSum[BANK_LANES];
+    int32_t peakBuffer[PEAK_BUFFER_LEN][BANK_LANES];
+    int peakPos[BANK_LANES]; // oldest entry of each lane's peak buffer
+
+    static int ctz(const uint32_t x) {
+        return __builtin_ctz(x);
+    }
+
+    void updatePeakThreshold(const int lane, const int newPeakVal) {
+        // peakDetect::updatePeakThreshold, the peak buffer is a plain ring of the last PEAK_BUFFER_LEN peaks
+        peakSum[lane] += newPeakVal - peakBuffer[peakPos[lane]][lane];
+        peakBuffer[peakPos[lane]][lane] = newPeakVal;
+        peakPos[lane] = (peakPos[lane] + 1) % PEAK_BUFFER_LEN;
+        peakThreshold[lane] = peakSum[lane] / thresholdScale[lane];
+    }
+
+    void resetPeakThreshold(const int lane) {
+        peakSum[lane] = 0;
+        peakThreshold[lane] = 0;
+        for (int jj = 0; jj < PEAK_BUFFER_LEN; jj++) {
+            peakBuffer[jj][lane] = 0;
+        }
+    }
+
+    // advances every lane's state machine, returns the mask of lanes with a peak and sets the mask of
+    // lanes whose threshold has to be reset; the peak threshold itself is updated by the caller
+    //
+    // per lane this is peakDetect::isPeak written without branches:
+    //   peak     = rising && lrs > rrs && lrs > threshold
+    //   enter    = !peak && !rising && counter > refractory && lrs < rrs
+    //   reset    = !peak && !enter && counter > resetPeriod
+    //   counter  = peak ? 0 : (enter ? counter : counter + 1)
+    //   rising   = (rising && !peak) || enter
+#if !defined(DETECTOR_BANK_SCALAR) && defined(__AVX2__)
+    uint32_t stepLanes(const int lrs, const int rrs, uint32_t& resets) {
+        const __m256i falling = _mm256_set1_epi32(lrs > rrs ? -1 : 0);
+        const __m256i rising = _mm256_set1_epi32(lrs < rrs ? -1 : 0);
+        const __m256i lrsVec = _mm256_set1_epi32(lrs);
+        const __m256i one = _mm256_set1_epi32(1);
+        uint32_t peaks = 0;
+        resets = 0;
+        for (int ii = 0; ii < BANK_LANES; ii += 8) {
+            __m256i edge = _mm256_load_si256((const __m256i*)(risingEdge + ii));
+            __m256i counter = _mm256_load_si256((const __m256i*)(rpCounter + ii));
+            __m256i threshold = _mm256_load_si256((const __m256i*)(peakThreshold + ii));
+            __m256i refractory = _mm256_load_si256((const __m256i*)(refractoryPeriod + ii));
+            __m256i resetPeriod = _mm256_load_si256((const __m256i*)(thresholdResetPeriod + ii));
+
+            __m256i peak = _mm256_and_si256(_mm256_and_si256(edge, falling), _mm256_cmpgt_epi32(lrsVec, threshold));
+            __m256i enter = _mm256_andnot_si256(_mm256_or_si256(peak, edge),
+                                                _mm256_and_si256(_mm256_cmpgt_epi32(counter, refractory), rising));
+            __m256i idle = _mm256_andnot_si256(_mm256_or_si256(peak, enter), _mm256_set1_epi32(-1));
+            __m256i reset = _mm256_and_si256(idle, _mm256_cmpgt_epi32(counter, resetPeriod));
+
+            counter = _mm256_andnot_si256(peak, _mm256_add_epi32(counter, _mm256_and_si256(idle, one)));
+            edge = _mm256_or_si256(_mm256_andnot_si256(peak, edge), enter);
+            _mm256_store_si256((__m256i*)(rpCounter + ii), counter);
+            _mm256_store_si256((__m256i*)(risingEdge + ii), edge);
+
+            peaks |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(peak)) << ii;
+            resets |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(reset)) << ii;
+        }
+        return peaks;
+    }
+#elif !defined(DETECTOR_BANK_SCALAR) && defined(__SSE2__)
+    uint32_t stepLanes(const int lrs, const int rrs, uint32_t& resets) {
+        const __m128i falling = _mm_set1_epi32(lrs > rrs ? -1 : 0);
+        const __m128i rising = _mm_set1_epi32(lrs < rrs ? -1 : 0);
+        const __m128i lrsVec = _mm_set1_epi32(lrs);
+        const __m128i one = _mm_set1_epi32(1);
+        uint32_t peaks = 0;
+        resets = 0;
+        for (int ii = 0; ii < BANK_LANES; ii += 4) {
+            __m128i edge = _mm_load_si128((const __m128i*)(risingEdge + ii));
+            __m128i counter = _mm_load_si128((const __m128i*)(rpCounter + ii));
+            __m128i threshold = _mm_load_si128((const __m128i*)(peakThreshold + ii));
+            __m128i refractory = _mm_load_si128((const __m128i*)(refractoryPeriod + ii));
+            __m128i resetPeriod = _mm_load_si128((const __m128i*)(thresholdResetPeriod + ii));
+
+            __m128i peak = _mm_and_si128(_mm_and_si128(edge, falling), _mm_cmpgt_epi32(lrsVec, threshold));
+            __m128i enter = _mm_andnot_si128(_mm_or_si128(peak, edge),
+                                             _mm_and_si128(_mm_cmpgt_epi32(counter, refractory), rising));
+            __m128i idle = _mm_andnot_si128(_mm_or_si128(peak, enter), _mm_set1_epi32(-1));
+            __m128i reset = _mm_and_si128(idle, _mm_cmpgt_epi32(counter, resetPeriod));
+
+            counter = _mm_andnot_si128(peak, _mm_add_epi32(counter, _mm_and_si128(idle, one)));
+            edge = _mm_or_si128(_mm_andnot_si128(peak, edge), enter);
+            _mm_store_si128((__m128i*)(rpCounter + ii), counter);
+            _mm_store_si128((__m128i*)(risingEdge + ii), edge);
+
+            peaks |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(peak)) << ii;
+            resets |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(reset)) << ii;
+        }
+        return peaks;
+    }
+#else
+    uint32_t stepLanes(const int lrs, const int rrs, uint32_t& resets) {
+        uint32_t peaks = 0;
+        resets = 0;
+        for (int ii = 0; ii < BANK_LANES; ii++) {
+            bool edge = risingEdge[ii] != 0;
+            bool peak = edge && lrs > rrs && lrs > peakThreshold[ii];
+            bool enter = !peak && !edge && rpCounter[ii] > refractoryPeriod[ii] && lrs < rrs;
+            bool idle = !peak && !enter;
+            if (idle && rpCounter[ii] > thresholdResetPeriod[ii]) {
+                resets |= 1u << ii;
+            }
+            rpCounter[ii] = peak ? 0 : rpCounter[ii] + idle;
+            risingEdge[ii] = ((edge && !peak) || enter) ? -1 : 0;
+            if (peak) {
+                peaks |= 1u << ii;
+            }
+        }
+        return peaks;
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ Loading recorded logs and scoring detected beats, shared by the host replay tools.
+*/
+
+#ifndef __RECORDING__
+#define __RECORDING__
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+
+const double SIXTEEN_BIT_TO_COUNTS = 19859; // must match realtimePlot.py
+const int MATCH_WINDOW = 10; // samples, beats closer than this are considered the same beat
+const int SAMPLING_PERIOD = 4; // milliseconds
+// realtimePlot logs only have every 4th sample (the firmware's SAMPLE_SEND_PERIOD + 1)
+const int REALTIME_PLOT_DECIMATION = 4;
+
+struct recording {
+    std::vector<int> samples;
+    std::vector<int> triggers; // sample indices of the triggers sent during the recording
+
+    void add(const int sample, const bool trigger) {
+        // a trigger pulse can span several logged samples, only its first sample counts
+        if (trigger && !lastTrigger) {
+            triggers.push_back(samples.size());
+        }
+        samples.push_back(sample);
+        lastTrigger = trigger;
+    }
+    bool lastTrigger = false;
+};
+
+inline bool loadRecording(const char* path, recording& rec) {
+    std::ifstream f(path);
+    if (!f) {
+        return false;
+    }
+    std::string line;
+    std::getline(f, line);
+    bool blackBox = line.compare(0, 6, "sample") == 0;
+    bool haveLast = false;
+    int lastValue = 0;
+    bool lastTrigger = false;
+    while (std::getline(f, line)) {
+        std::istringstream row(line);
+        std::string time, value, trigger;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        if (blackBox) { // sample time adc_counts trigger pot_code
+            std::string index;
+            row >> index >> time >> value >> trigger;
+            rec.add(atoi(value.c_str()), atoi(trigger.c_str()) != 0);
+        } else { // time: volts trigger_marker
+            // the detectors are tuned for 4 ms samples, so the 16 ms log is linearly interpolated back up to
+            // the full rate; a sample's trigger marker is held over the samples interpolated after it
+            row >> time >> value >> trigger;
+            int sample = (int)(atof(value.c_str()) * SIXTEEN_BIT_TO_COUNTS);
+            if (haveLast) {
+                for (int ii = 1; ii < REALTIME_PLOT_DECIMATION; ii++) {
+                    rec.add(lastValue + (sample - lastValue) * ii / REALTIME_PLOT_DECIMATION, lastTrigger);
+                }
+            }
+            lastTrigger = atof(trigger.c_str()) > 0;
+            rec.add(sample, lastTrigger);
+            lastValue = sample;
+            haveLast = true;
+        }
+    }
+    return true;
+}
+
+struct matchStats {
+    int matched;
+    int missed;
+    int extra;
+    double latencyMs; // mean offset of the matched beats from the reference
+};
+
+inline matchStats matchBeats(const std::vector<int>& beats, const std::vector<int>& reference) {
+    // greedy matching of each beat to the nearest unmatched reference beat
+    matchStats m;
+    size_t jj = 0;
+    long offsetSum = 0;
+    m.matched = 0;
+    for (size_t ii = 0; ii < beats.size(); ii++) {
+        while (jj < reference.size() && reference[jj] < beats[ii] - MATCH_WINDOW) {
+            jj++;
+        }
+        if (jj < reference.size() && reference[jj] <= beats[ii] + MATCH_WINDOW) {
+            offsetSum += beats[ii] - reference[jj];
+            m.matched++;
+            jj++;
+        }
+    }
+    m.missed = reference.size() - m.matched;
+    m.extra = beats.size() - m.matched;
+    m.latencyMs = m.matched ? (double)offsetSum * SAMPLING_PERIOD / m.matched : 0.0;
+    return m;
+}
+
+#endif
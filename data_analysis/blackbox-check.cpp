@@ -0,0 +1,248 @@
+/*
+ Host check of the black box recorder, the detector trace and blackbox-dump.py.
+
+ Feeds a known sequence of samples, trigger and gain events and trace records into
+ blackBoxRecorder and detectorTrace, long enough for every ring to wrap, with one dump
+ made part way through while sampling carries on (its samples must keep their time
+ and hold the last value recorded before it). It then writes the final dumps to a file with telemetry lines before and between them, as they would
+ arrive over serial. blackbox-dump.py then reassembles the file, and every row it
+ writes is checked against what was fed in.
+
+ build:
+    g++ -std=c++11 -O2 -I../pressure_trigger_module -o blackbox-check blackbox-check.cpp
+
+ usage (from data_analysis, python is taken from $PYTHON if set):
+    blackbox-check [output prefix]
+
+ Writes <prefix>.bin, <prefix>.log and <prefix>.log.trace (default prefix blackbox-check)
+ and exits with an error if anything doesn't match.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "BlackBoxRecorder.h"
+#include "DetectorTrace.h"
+
+const uint32_t CHECK_SAMPLE_PERIOD_US = 4000;
+const int CHECK_SAMPLES = 20000; // more than BLACKBOX_SAMPLE_LEN, so the sample ring wraps
+const int CHECK_TRIGGER_INTERVAL = 25; // samples, enough triggers to wrap the event ring
+const int CHECK_GAIN_INTERVAL = 1000;
+const int CHECK_TRACE_INTERVAL = 64; // samples, enough records to wrap the trace ring
+const uint32_t CHECK_DUMP_AT = 12150; // sample after which a dump is made while sampling carries on
+const int CHECK_DUMP_SAMPLES_PER_WRITE = 3;
+
+struct fileOutput {
+    FILE* f;
+    size_t write(const uint8_t* data, const size_t n) {
+        return fwrite(data, 1, n, f);
+    }
+};
+
+static uint16_t sampleValue(const uint32_t index) {
+    return (uint16_t)(index * 37 + 1000);
+}
+
+struct checkedEvent {
+    uint32_t index;
+    uint16_t type;
+    uint16_t value;
+};
+
+static int failures = 0;
+
+static blackBoxRecorder recorder(CHECK_SAMPLE_PERIOD_US);
+static uint32_t nextSample = 0;
+static bool dumping = false;
+static uint32_t skipped = 0; // samples taken during the last dump, until the recorder marks them with a gap event
+static std::vector<uint16_t> expectedSamples; // what the dump should hold for each sample index
+static std::vector<checkedEvent> events;
+static std::vector<traceRecord> records;
+
+static void sampleInterrupt() {
+    // what the sketch's sample() does with the recorder and the trace, events are lost during a dump
+    uint32_t ii = nextSample++;
+    recorder.addSample(sampleValue(ii));
+    if (dumping) {
+        skipped++;
+    } else if (skipped) {
+        events.push_back(checkedEvent{ii - skipped - 1, BLACKBOX_GAP, (uint16_t)skipped});
+        skipped = 0;
+    }
+    expectedSamples.push_back(dumping ? expectedSamples.back() : sampleValue(ii));
+    trace.tick = recorder.lastSampleIndex();
+    if (ii % CHECK_TRIGGER_INTERVAL == 0 && !dumping) {
+        recorder.addEvent(BLACKBOX_TRIGGER, 0);
+        events.push_back(checkedEvent{ii, BLACKBOX_TRIGGER, 0});
+    }
+    if (ii % CHECK_GAIN_INTERVAL == 0 && !dumping) {
+        uint16_t code = ii / CHECK_GAIN_INTERVAL;
+        recorder.addEvent(BLACKBOX_GAIN, code);
+        events.push_back(checkedEvent{ii, BLACKBOX_GAIN, code});
+    }
+    if (ii % CHECK_TRACE_INTERVAL == 0) {
+        trace.add(TRACE_PEAK, -(int32_t)ii);
+        records.push_back(traceRecord{ii, -(int32_t)ii});
+    }
+}
+
+struct interruptedOutput {
+    // the sampling interrupt fires CHECK_DUMP_SAMPLES_PER_WRITE times during every write
+    FILE* f;
+    size_t write(const uint8_t* data, const size_t n) {
+        for (int ii = 0; ii < CHECK_DUMP_SAMPLES_PER_WRITE; ii++) {
+            sampleInterrupt();
+        }
+        return fwrite(data, 1, n, f);
+    }
+};
+
+static void fail(const char* what, const uint32_t index, const long expected, const long actual) {
+    if (failures < 10) {
+        fprintf(stderr, "%s at sample %u: expected %ld, got %ld\n", what, index, expected, actual);
+    }
+    failures++;
+}
+
+int main(int argc, char** argv) {
+    std::string prefix = argc > 1 ? argv[1] : "blackbox-check";
+    const char* python = getenv("PYTHON") ? getenv("PYTHON") : "python";
+
+    while (nextSample < (uint32_t)CHECK_SAMPLES) {
+        sampleInterrupt();
+        if (nextSample == CHECK_DUMP_AT) {
+            // a dump with the sampling interrupt still running, the samples it skips must keep their time
+            interruptedOutput discard = {fopen("/dev/null", "wb")};
+            dumping = true;
+            recorder.dump(discard);
+            dumping = false;
+            fclose(discard.f);
+        }
+    }
+
+    std::string binPath = prefix + ".bin";
+    fileOutput out = {fopen(binPath.c_str(), "wb")};
+    if (!out.f) {
+        perror(binPath.c_str());
+        return 1;
+    }
+    fputs("30000 0\n30100 1\n", out.f);
+    recorder.dump(out);
+    fputs("30200 0\nQ 100 0\n", out.f);
+    trace.dump(out);
+    fclose(out.f);
+
+    std::string logPath = prefix + ".log";
+    std::string command = std::string(python) + " blackbox-dump.py " + binPath + " " + logPath;
+    if (system(command.c_str()) != 0) {
+        fprintf(stderr, "%s failed\n", command.c_str());
+        return 1;
+    }
+
+    // what blackbox-dump.py should make of it: the newest BLACKBOX_SAMPLE_LEN samples, the newest
+    // BLACKBOX_EVENT_LEN events and the newest TRACE_LEN records
+    uint32_t firstIndex = nextSample - BLACKBOX_SAMPLE_LEN;
+    std::set<uint32_t> triggers;
+    std::map<uint32_t, int> gains;
+    int potCode = -1;
+    for (size_t ii = events.size() - BLACKBOX_EVENT_LEN; ii < events.size(); ii++) {
+        if (events[ii].type == BLACKBOX_TRIGGER) {
+            triggers.insert(events[ii].index);
+        } else if (events[ii].type == BLACKBOX_GAP) {
+            continue;
+        } else if (events[ii].index < firstIndex) {
+            potCode = events[ii].value;
+        } else {
+            gains[events[ii].index] = events[ii].value;
+        }
+    }
+
+    FILE* log = fopen(logPath.c_str(), "r");
+    if (!log) {
+        perror(logPath.c_str());
+        return 1;
+    }
+    char header[256];
+    if (!fgets(header, sizeof(header), log) || strcmp(header, "sample time adc_counts trigger pot_code\n") != 0) {
+        fprintf(stderr, "%s: unexpected header\n", logPath.c_str());
+        return 1;
+    }
+    unsigned index;
+    double time;
+    int sample, trigger, pot;
+    uint32_t rows = 0;
+    while (fscanf(log, "%u %lf %d %d %d", &index, &time, &sample, &trigger, &pot) == 5) {
+        uint32_t expected = firstIndex + rows;
+        if (gains.count(expected)) {
+            potCode = gains[expected];
+        }
+        if (index != expected) {
+            fail("sample index", expected, expected, index);
+        }
+        if ((long)(time * 1000 + 0.5) != (long)expected * CHECK_SAMPLE_PERIOD_US / 1000) {
+            fail("time (ms)", expected, (long)expected * CHECK_SAMPLE_PERIOD_US / 1000, (long)(time * 1000 + 0.5));
+        }
+        if (sample != expectedSamples[expected]) {
+            fail("adc counts", expected, expectedSamples[expected], sample);
+        }
+        if (trigger != (int)triggers.count(expected)) {
+            fail("trigger", expected, triggers.count(expected), trigger);
+        }
+        if (pot != potCode) {
+            fail("pot code", expected, potCode, pot);
+        }
+        rows++;
+    }
+    fclose(log);
+    if (rows != BLACKBOX_SAMPLE_LEN) {
+        fail("row count", rows, BLACKBOX_SAMPLE_LEN, rows);
+    }
+
+    std::string tracePath = logPath + ".trace";
+    FILE* traceLog = fopen(tracePath.c_str(), "r");
+    if (!traceLog) {
+        perror(tracePath.c_str());
+        return 1;
+    }
+    if (!fgets(header, sizeof(header), traceLog) || strcmp(header, "sample event value\n") != 0) {
+        fprintf(stderr, "%s: unexpected header\n", tracePath.c_str());
+        return 1;
+    }
+    char event[64];
+    int value;
+    size_t next = records.size() - TRACE_LEN;
+    while (fscanf(traceLog, "%u %63s %d", &index, event, &value) == 3) {
+        if (next >= records.size()) {
+            fail("trace record count", index, records.size(), next + 1);
+            break;
+        }
+        const traceRecord& r = records[next++];
+        if (index != r.eventTick) {
+            fail("trace sample index", r.eventTick, r.eventTick, index);
+        }
+        if (strcmp(event, "peak") != 0) {
+            fail("trace event is not a peak", r.eventTick, TRACE_PEAK, -1);
+        }
+        if (value != r.value) {
+            fail("trace value", r.eventTick, r.value, value);
+        }
+    }
+    fclose(traceLog);
+    if (next != records.size()) {
+        fail("trace record count", next, records.size(), next);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d mismatches\n", failures);
+        return 1;
+    }
+    printf("%u samples, %zu events and %u trace records match\n", rows, events.size() < BLACKBOX_EVENT_LEN ?
+           events.size() : BLACKBOX_EVENT_LEN, TRACE_LEN);
+    return 0;
+}
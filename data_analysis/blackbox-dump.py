@@ -0,0 +1,192 @@
+"""Retrieve the black box recording from the pressure trigger module.
+
+The triggering unit keeps the last ~65 seconds of raw ADC samples, trigger events
+and gain changes in RAM. Sending DUMP over the serial port makes it stream the
+recording as binary, this script finds the dump in the serial stream and
+reassembles it into a plain text log with one row per sample.
+
+It then sends TRACE to retrieve the detector state transitions recorded since the
+last TRACE command, and writes them to a second file (recovered.log.trace) with
+one row per event. With --plot the waveform is drawn with the events on top.
+
+usage:
+    python blackbox-dump.py [--plot] COM3 recovered.log      (read from the triggering unit)
+    python blackbox-dump.py [--plot] dump.bin recovered.log  (reassemble a previously saved dump)
+"""
+from __future__ import division
+
+import os
+import struct
+import sys
+
+# must match BlackBoxRecorder.h
+BLACKBOX_MAGIC = b'BBX1'
+HEADER_FORMAT = '<6I'
+EVENT_FORMAT = '<IHH'
+BLACKBOX_TRIGGER = 1
+BLACKBOX_GAIN = 2
+BLACKBOX_GAP = 3
+
+# must match DetectorTrace.h
+TRACE_MAGIC = b'TRC1'
+TRACE_HEADER_FORMAT = '<4I'
+TRACE_RECORD_FORMAT = '<Ii'
+TRACE_EVENTS = {
+    0: 'overwritten',
+    1: 'peak',
+    2: 'refractory_exit',
+    3: 'threshold_update',
+    4: 'threshold_reset',
+    5: 'seek_state',
+    6: 'gain_target',
+    7: 'template_learned',
+    8: 'template_reset',
+    9: 'beat_quality',
+    10: 'trigger_delayed',
+    11: 'trigger_dropped',
+}
+
+SERIAL_BAUDRATE = 115200
+
+
+def read_exactly(stream, n):
+    data = b''
+    while len(data) < n:
+        chunk = stream.read(n - len(data))
+        if not chunk:
+            raise IOError("dump ended after {} of {} bytes".format(len(data), n))
+        data += chunk
+    return data
+
+
+def find_magic(stream, magic):
+    """skip over any telemetry that was sent before the dump started"""
+    window = b''
+    while window != magic:
+        c = stream.read(1)
+        if not c:
+            raise IOError("no {} dump found".format(magic.decode('ascii')))
+        window = (window + c)[-len(magic):]
+
+
+def read_dump(stream):
+    """returns (header dict, list of samples, list of (sample index, type, value) events)"""
+    find_magic(stream, BLACKBOX_MAGIC)
+    fields = struct.unpack(HEADER_FORMAT, BLACKBOX_MAGIC + read_exactly(stream, struct.calcsize(HEADER_FORMAT) - 4))
+    header = dict(zip(('magic', 'sample_period_us', 'sample_head', 'sample_count', 'event_head', 'event_count'), fields))
+
+    samples = struct.unpack('<{}H'.format(header['sample_count']), read_exactly(stream, 2 * header['sample_count']))
+    event_size = struct.calcsize(EVENT_FORMAT)
+    event_data = read_exactly(stream, event_size * header['event_count'])
+    events = [struct.unpack_from(EVENT_FORMAT, event_data, i * event_size) for i in range(header['event_count'])]
+    return header, samples, events
+
+
+def read_trace(stream):
+    """returns a list of (sample index, event name, value) detector state transitions"""
+    find_magic(stream, TRACE_MAGIC)
+    tick, lost, count = struct.unpack('<3I', read_exactly(stream, struct.calcsize(TRACE_HEADER_FORMAT) - 4))
+    if lost:
+        print("warning: {} trace records were overwritten before they were read".format(lost))
+    record_size = struct.calcsize(TRACE_RECORD_FORMAT)
+    data = read_exactly(stream, record_size * count)
+    records = []
+    for i in range(count):
+        event_tick, value = struct.unpack_from(TRACE_RECORD_FORMAT, data, i * record_size)
+        event = event_tick >> 24
+        # records only keep the low 24 bits of the sample index
+        index = tick - ((tick - event_tick) & 0xFFFFFF)
+        records.append((index, TRACE_EVENTS.get(event, str(event)), value))
+    return records
+
+
+def plot(rows, records):
+    from pylab import plot, xlabel, ylabel, title, grid, show, annotate, axvline
+
+    times = [row[1] for row in rows]
+    plot(times, [row[2] for row in rows], 'b-')
+    plot([row[1] for row in rows if row[3]], [row[2] for row in rows if row[3]], 'ro')
+    if rows:
+        first_index = rows[0][0]
+        period = rows[1][1] - rows[0][1] if len(rows) > 1 else 0.004
+        for index, event, value in records:
+            if index < first_index or index - first_index >= len(rows):
+                continue
+            t = (index - first_index) * period + rows[0][1]
+            axvline(t, color='0.7', linestyle=':')
+            annotate("{} {}".format(event, value), (t, rows[index - first_index][2]),
+                     rotation=90, fontsize='x-small')
+    xlabel('time (s)')
+    ylabel('ADC counts')
+    title('black box recording')
+    grid(True)
+    show()
+
+
+def reassemble(header, samples, events):
+    """merge samples and events into rows of (sample index, time (s), adc counts, trigger, pot code)"""
+    first_index = header['sample_head'] - header['sample_count']
+    period = header['sample_period_us'] / 1e6
+    triggers = set()
+    gain = {}
+    pot_code = -1 # unknown unless a gain change was recorded
+    for index, event_type, value in events:
+        if event_type == BLACKBOX_TRIGGER:
+            triggers.add(index)
+        elif event_type == BLACKBOX_GAIN and index < first_index:
+            pot_code = value # gain change older than the oldest sample still applies to it
+        elif event_type == BLACKBOX_GAIN:
+            gain[index] = value
+        elif event_type == BLACKBOX_GAP and index >= first_index:
+            print("warning: {} samples after sample {} were taken during a dump, they repeat its value".format(value, index))
+
+    rows = []
+    for offset, sample in enumerate(samples):
+        index = first_index + offset
+        pot_code = gain.get(index, pot_code)
+        rows.append((index, index * period, sample, int(index in triggers), pot_code))
+    return rows
+
+
+def open_source(source):
+    if os.path.isfile(source):
+        return open(source, 'rb')
+    import serial
+    return serial.Serial(source, SERIAL_BAUDRATE, timeout=5)
+
+
+if __name__ == '__main__':
+    args = [arg for arg in sys.argv[1:] if arg != '--plot']
+    if len(args) != 2:
+        print(__doc__)
+        sys.exit(1)
+
+    stream = open_source(args[0])
+    from_device = not os.path.isfile(args[0])
+    records = []
+    try:
+        if from_device:
+            stream.write(b'DUMP\n')
+        header, samples, events = read_dump(stream)
+        if from_device:
+            stream.write(b'TRACE\n')
+        try:
+            records = read_trace(stream)
+        except IOError:
+            print("no detector trace found")
+    finally:
+        stream.close()
+
+    rows = reassemble(header, samples, events)
+    with open(args[1], 'w') as f:
+        f.write("sample time adc_counts trigger pot_code\n")
+        for row in rows:
+            f.write("{} {:.3f} {} {} {}\n".format(*row))
+    with open(args[1] + '.trace', 'w') as f:
+        f.write("sample event value\n")
+        for record in records:
+            f.write("{} {} {}\n".format(*record))
+    print("recovered {} samples, {} events and {} trace records".format(len(samples), len(events), len(records)))
+
+    if '--plot' in sys.argv:
+        plot(rows, records)
@@ -0,0 +1,84 @@
+/*
+ Host check of the runtime config's SET/GET protocol (runtimeConfig::handleLine).
+
+ Sends command lines to a runtimeConfig and compares each reply line with the one
+ expected, calling swap() where the sampling interrupt would. Covers accepted and
+ refused SETs, the reset period vs refractory period rule, a SET made before the
+ previous one was swapped in, and the GET format.
+
+ build:
+    g++ -std=c++11 -O2 -I../pressure_trigger_module -o config-check config-check.cpp
+
+ usage:
+    config-check
+
+ Exits with an error if any reply differs.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "RuntimeConfig.h"
+
+struct exchange {
+    const char* line;
+    const char* reply; // NULL if the line isn't a SET or GET command
+    bool swapAfter; // whether the interrupt swaps before the next line
+};
+
+const exchange CHECK_EXCHANGES[] = {
+    {"GET", "A threshold_scale 7 refractory_period 40 threshold_reset_period 1250 correction 5 pulse_duration 20 "
+            "trigger_policy 0 trigger_hold 12 scanner_busy 0\n", false},
+    {"SET threshold_scale 9", "A OK threshold_scale 9\n", true},
+    {"SET foo 1", "A ERR unknown parameter\n", false},
+    {"SET threshold_scale 51", "A ERR out of range\n", false},
+    {"SET threshold_scale 0", "A ERR out of range\n", false},
+    {"SET correction 99999999999", "A ERR out of range\n", false},
+    {"SET correction x", "A ERR value must be an integer\n", false},
+    {"SET correction 3x", "A ERR value must be an integer\n", false},
+    {"SET correction ", "A ERR value must be an integer\n", false},
+    {"SET correction", "A ERR expected SET <name> <value>\n", false},
+    {"SET a_parameter_name_that_is_far_too_long 3", "A ERR unknown parameter\n", false},
+    // the reset period must stay longer than the refractory period, whichever one is changed
+    {"SET threshold_reset_period 250", "A OK threshold_reset_period 250\n", true},
+    {"SET refractory_period 250", "A ERR threshold_reset_period must be longer than refractory_period\n", false},
+    {"SET threshold_reset_period 300", "A OK threshold_reset_period 300\n", true},
+    {"SET refractory_period 250", "A OK refractory_period 250\n", true},
+    {"SET threshold_reset_period 250", "A ERR threshold_reset_period must be longer than refractory_period\n", false},
+    {"SET refractory_period 40", "A OK refractory_period 40\n", true},
+    {"SET threshold_reset_period 1250", "A OK threshold_reset_period 1250\n", true},
+    // a second SET before the interrupt has swapped in the first is refused, and accepted after the swap
+    {"SET correction 3", "A OK correction 3\n", false},
+    {"SET pulse_duration 12", "A ERR busy\n", false},
+    {"GET", "A threshold_scale 9 refractory_period 40 threshold_reset_period 1250 correction 5 pulse_duration 20 "
+            "trigger_policy 0 trigger_hold 12 scanner_busy 0\n", true},
+    {"SET pulse_duration 12", "A OK pulse_duration 12\n", true},
+    {"GET", "A threshold_scale 9 refractory_period 40 threshold_reset_period 1250 correction 3 pulse_duration 12 "
+            "trigger_policy 0 trigger_hold 12 scanner_busy 0\n", false},
+    {"DUMP", NULL, false},
+    {"get", NULL, false},
+};
+
+int main() {
+    int failures = 0;
+    int count = sizeof(CHECK_EXCHANGES) / sizeof(CHECK_EXCHANGES[0]);
+    for (int ii = 0; ii < count; ii++) {
+        const exchange& e = CHECK_EXCHANGES[ii];
+        char reply[RUNTIME_REPLY_LEN] = "";
+        bool handled = config.handleLine(e.line, reply, sizeof(reply));
+        if (handled != (e.reply != NULL) || (handled && strcmp(reply, e.reply) != 0)) {
+            fprintf(stderr, "\"%s\": expected %s", e.line, e.reply ? e.reply : "not handled\n");
+            fprintf(stderr, "%*s  got %s", (int)strlen(e.line), "", handled ? reply : "not handled\n");
+            failures++;
+        }
+        if (e.swapAfter) {
+            config.swap();
+        }
+    }
+    if (failures) {
+        fprintf(stderr, "%d of %d replies differ\n", failures, count);
+        return 1;
+    }
+    printf("%d command lines answered as expected\n", count);
+    return 0;
+}
@@ -0,0 +1,449 @@
+/*
+ Replays a recorded pressure signal through the firmware's beat detectors on the host
+ and compares them, so detector changes can be evaluated without an animal on the table.
+
+ build:
+    g++ -std=c++11 -O2 -I../pressure_trigger_module -o detector-replay detector-replay.cpp
+
+ usage:
+    detector-replay recording.log
+
+ The recording is either a log written by blackbox-dump.py (raw ADC counts at the
+ full 4 ms sample rate) or a realtimePlot log (volts, every 4th sample), which is
+ interpolated back up to 4 ms samples. Each detector is run on the same low pass filtered
+ slope sum signal; its beats are matched against the peakDetect beats within
+ MATCH_WINDOW samples, and against the triggers recorded in the log.
+
+ The signal is filtered with the block API in REPLAY_BLOCK_LEN sample blocks, and
+ checked against the per-sample API, which must give bit for bit identical output.
+ peakDetect's block API must also write the same detector trace records, sample ticks included.
+
+ The signal quality index is run alongside peakDetect, and the beats it would let
+ through to the scanner (score >= SQI_TRIGGER_THRESHOLD) are scored like a detector.
+
+ peakDetect's beats are then sent through the trigger scheduler with the simulated
+ scanner busy for SCANNER_BUSY_PERCENT of the mean RR interval after each trigger,
+ and each trigger policy's scan efficiency (the fraction of the recording the scanner
+ spends acquiring) is reported.
+
+ The signal is then cut by a GAP_LEN second flat gap, after which the detectors must pick
+ the beats up again without ever reporting two beats within the refractory period.
+
+ Finally the unit is restarted at RESTART_COUNT points through the recording, once from
+ scratch and once from the warm start state saved to a mock EEPROM, and the beats found
+ in the RESTART_WINDOW seconds after each restart are compared with the uninterrupted
+ run. Beats that were already on their upstroke at the restart are left out.
+
+ Exits with an error if the block API output differs from the per-sample API, if beats come
+ closer than the refractory period after the gap, or if the warm start matches fewer beats or finds more extra beats than the cold start.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+
+#include "PressurePeakDetect.h"
+#include "TemplateMatchDetect.h"
+#include "SignalQuality.h"
+#include "WarmStart.h"
+#include "BeatStatistics.h"
+#include "TriggerScheduler.h"
+#include "Recording.h"
+
+const int REPLAY_BLOCK_LEN = 64; // samples per block, as delivered by one DMA half buffer
+const int GAP_LEN = 8; // seconds of flat signal inserted to check the detectors recover from a lost signal
+const int RESTART_COUNT = 8; // restarts, evenly spaced through the recording
+const int RESTART_WINDOW = 10; // seconds after each restart that are compared
+// samples after a restart before beats are compared: the slope sum window plus the match window
+const int RESTART_SETTLE = BUFFER_LEN + MATCH_WINDOW;
+const int REPLAY_GAIN_POT = 3;
+const int SCANNER_BUSY_PERCENT[] = {80, 95, 105};
+const char* TRIGGER_POLICY_NAMES[] = {"fire", "hold", "drop"};
+
+struct memoryStorage {
+    uint8_t bytes[sizeof(warmStartState)];
+    int writes = 0;
+    memoryStorage() {
+        for (size_t ii = 0; ii < sizeof(bytes); ii++) {
+            bytes[ii] = 0xFF; // erased EEPROM
+        }
+    }
+    uint8_t read(const int address) {
+        return bytes[address];
+    }
+    void write(const int address, const uint8_t value) {
+        bytes[address] = value;
+        writes++;
+    }
+};
+
+struct result {
+    std::vector<int> beats;
+    double nsPerSample;
+};
+
+template <class Detector>
+static result run(const std::vector<int>& ssf) {
+    // the detector is timed on its own, the filters are shared by every detector
+    Detector detector;
+    result r;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t ii = 0; ii < ssf.size(); ii++) {
+        if (detector.isPeak(ssf[ii])) {
+            r.beats.push_back(ii);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    r.nsPerSample = std::chrono::duration<double, std::nano>(elapsed).count() / ssf.size();
+    return r;
+}
+
+static result runBlocks(const std::vector<int>& ssf) {
+    peakDetect detector;
+    result r;
+    std::vector<int> offsets(REPLAY_BLOCK_LEN);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t ii = 0; ii < ssf.size(); ii += REPLAY_BLOCK_LEN) {
+        int n = std::min<size_t>(REPLAY_BLOCK_LEN, ssf.size() - ii);
+        int peaks = detector.findPeaks(&ssf[ii], n, &offsets[0]);
+        for (int jj = 0; jj < peaks; jj++) {
+            r.beats.push_back(ii + offsets[jj]);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    r.nsPerSample = std::chrono::duration<double, std::nano>(elapsed).count() / ssf.size();
+    return r;
+}
+
+struct traceCollector {
+    std::vector<uint8_t> bytes;
+    size_t write(const uint8_t* data, const size_t n) {
+        bytes.insert(bytes.end(), data, data + n);
+        return n;
+    }
+};
+
+static std::vector<traceRecord> collectTrace(const std::vector<int>& ssf, const bool blocks) {
+    // peakDetect's trace records with trace.tick set as the sampling interrupt sets it, using the block or the
+    // per-sample API; the trace is drained after every block so the ring never wraps
+    peakDetect detector;
+    std::vector<int> offsets(REPLAY_BLOCK_LEN);
+    std::vector<traceRecord> records;
+    traceCollector out;
+    trace.dump(out); // drop what the earlier runs left
+    for (size_t ii = 0; ii < ssf.size(); ii += REPLAY_BLOCK_LEN) {
+        int n = std::min<size_t>(REPLAY_BLOCK_LEN, ssf.size() - ii);
+        trace.tick = ii;
+        if (blocks) {
+            detector.findPeaks(&ssf[ii], n, &offsets[0]);
+        }
+        for (int jj = 0; jj < n && !blocks; jj++) {
+            trace.tick = ii + jj;
+            detector.isPeak(ssf[ii + jj]);
+        }
+        out.bytes.clear();
+        trace.dump(out);
+        const traceRecord* r = (const traceRecord*)&out.bytes[sizeof(traceHeader)];
+        records.insert(records.end(), r, r + (out.bytes.size() - sizeof(traceHeader)) / sizeof(traceRecord));
+    }
+    return records;
+}
+
+static bool sameTrace(const std::vector<traceRecord>& a, const std::vector<traceRecord>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t ii = 0; ii < a.size(); ii++) {
+        if (a[ii].eventTick != b[ii].eventTick || a[ii].value != b[ii].value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::vector<int> filterSamples(const std::vector<int>& samples, double& nsPerSample) {
+    lowPassFilter filt;
+    slopeSumFilter ssf;
+    std::vector<int> lpfVals(samples.size());
+    std::vector<int> ssfVals(samples.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t ii = 0; ii < samples.size(); ii++) {
+        lpfVals[ii] = filt.step(samples[ii]);
+        ssfVals[ii] = ssf.step(lpfVals[ii]);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    nsPerSample = std::chrono::duration<double, std::nano>(elapsed).count() / samples.size();
+    return ssfVals;
+}
+
+static std::vector<int> filterBlocks(const std::vector<int>& samples, double& nsPerSample) {
+    lowPassFilter filt;
+    slopeSumFilter ssf;
+    std::vector<int> lpfVals(samples.size());
+    std::vector<int> ssfVals(samples.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t ii = 0; ii < samples.size(); ii += REPLAY_BLOCK_LEN) {
+        int n = std::min<size_t>(REPLAY_BLOCK_LEN, samples.size() - ii);
+        filt.step(&samples[ii], &lpfVals[ii], n);
+        ssf.step(&lpfVals[ii], &ssfVals[ii], n);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    nsPerSample = std::chrono::duration<double, std::nano>(elapsed).count() / samples.size();
+    return ssfVals;
+}
+
+static result runQuality(const std::vector<int>& samples, const std::vector<int>& ssf, const std::vector<int>& beats) {
+    // scores each of peakDetect's beats, and returns the ones that would still trigger the scanner
+    lowPassFilter filt;
+    std::vector<int> lpfVals(samples.size());
+    for (size_t ii = 0; ii < samples.size(); ii++) {
+        lpfVals[ii] = filt.step(samples[ii]);
+    }
+
+    signalQuality quality;
+    result gated;
+    long scoreSum = 0;
+    int flagCounts[5] = {0, 0, 0, 0, 0};
+    size_t next = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t ii = 0; ii < samples.size(); ii++) {
+        quality.step(samples[ii], lpfVals[ii], ssf[ii]);
+        if (next < beats.size() && beats[next] == (int)ii) {
+            int score = quality.beat();
+            scoreSum += score;
+            for (int jj = 0; jj < 5; jj++) {
+                flagCounts[jj] += (quality.flags() >> jj) & 1;
+            }
+            if (score >= SQI_TRIGGER_THRESHOLD) {
+                gated.beats.push_back(ii);
+            }
+            next++;
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    gated.nsPerSample = std::chrono::duration<double, std::nano>(elapsed).count() / samples.size();
+
+    printf("signalQuality: %.1f ns/sample, mean score %.1f, beats flagged saturated %d, flat %d, amplitude %d, "
+           "shape %d, noisy %d\n", gated.nsPerSample, beats.empty() ? 0.0 : (double)scoreSum / beats.size(),
+           flagCounts[0], flagCounts[1], flagCounts[2], flagCounts[3], flagCounts[4]);
+    return gated;
+}
+
+static void compare(const char* name, const std::vector<int>& beats, const std::vector<int>& reference) {
+    matchStats m = matchBeats(beats, reference);
+    printf("  vs %-12s matched %d/%zu (missed %d, extra %d), mean latency %+.2f ms\n", name, m.matched,
+           reference.size(), m.missed, m.extra, m.latencyMs);
+}
+
+static void report(const char* name, const result& r, const result& reference, const recording& rec) {
+    printf("%s: %zu beats, %.1f ns/sample\n", name, r.beats.size(), r.nsPerSample);
+    compare("peakDetect", r.beats, reference.beats);
+    compare("log triggers", r.beats, rec.triggers);
+}
+
+static void runScheduler(const std::vector<int>& samples, const std::vector<int>& beats) {
+    // the mean RR interval of the whole recording sets the busy window
+    if (beats.size() < 2) {
+        return;
+    }
+    int meanRR = (beats.back() - beats.front()) * SAMPLING_PERIOD / (beats.size() - 1);
+    for (size_t ii = 0; ii < sizeof(SCANNER_BUSY_PERCENT) / sizeof(SCANNER_BUSY_PERCENT[0]); ii++) {
+        int busy = meanRR * SCANNER_BUSY_PERCENT[ii] / 100;
+        printf("trigger scheduler, scanner busy %d ms (%d%% of RR):\n", busy, SCANNER_BUSY_PERCENT[ii]);
+        for (int policy = TRIGGER_FIRE; policy <= TRIGGER_DROP; policy++) {
+            config.set("scanner_busy", busy);
+            config.swap();
+            config.set("trigger_policy", policy);
+            config.swap();
+            beatStatistics stats(SAMPLING_PERIOD);
+            triggerScheduler scheduler(SAMPLING_PERIOD);
+            scannerBusyModel scanner(SAMPLING_PERIOD);
+            long delaySamples = 0;
+            int held = -1; // sample of the beat being held
+            size_t next = 0;
+            beatRecord record;
+            for (size_t jj = 0; jj < samples.size(); jj++) {
+                stats.step(samples[jj]);
+                bool beat = next < beats.size() && beats[next] == (int)jj;
+                if (beat) {
+                    stats.beat(true, record);
+                    next++;
+                }
+                uint32_t wasDelayed = scheduler.delayed;
+                bool ready = scanner.ready();
+                bool send = scheduler.step(beat, ready, beat ? stats.meanRR() : 0);
+                scanner.step(send && ready);
+                if (scheduler.delayed != wasDelayed) {
+                    delaySamples += jj - held;
+                }
+                if (beat) {
+                    held = jj;
+                }
+            }
+            uint32_t scans = scheduler.accepted + scheduler.delayed;
+            printf("  %-5s %u acquisitions (%u delayed, mean delay %.1f ms), %u dropped, %u wasted, "
+                   "scan efficiency %.1f%%\n", TRIGGER_POLICY_NAMES[policy], scans, scheduler.delayed,
+                   scheduler.delayed ? (double)delaySamples * SAMPLING_PERIOD / scheduler.delayed : 0.0,
+                   scheduler.dropped, scheduler.wasted, 100.0 * scans * busy / ((double)samples.size() * SAMPLING_PERIOD));
+        }
+    }
+    config.set("trigger_policy", TRIGGER_POLICY);
+    config.swap();
+    config.set("scanner_busy", SCANNER_BUSY);
+    config.swap();
+}
+
+static bool runRestart(const std::vector<int>& samples, const std::vector<int>& reference) {
+    // restarts the filters and detector at RESTART_COUNT points, with and without the warm start state saved by
+    // the uninterrupted run at that point; returns false if the warm start finds fewer beats or more extra beats
+    int matched[2] = {0, 0};
+    int extra[2] = {0, 0};
+    int expectedTotal = 0;
+    int firstWrites = 0;
+    int unchangedWrites = 0;
+    int loadedCount = 0;
+    lowPassFilter filt;
+    slopeSumFilter ssf;
+    peakDetect before(false);
+    size_t pos = 0;
+    for (int rr = 1; rr <= RESTART_COUNT; rr++) {
+        size_t restart = samples.size() * rr / (RESTART_COUNT + 1);
+        size_t end = std::min(samples.size(), restart + RESTART_WINDOW * 1000 / SAMPLING_PERIOD);
+        for (; pos < restart; pos++) {
+            before.isPeak(ssf.step(filt.step(samples[pos])));
+        }
+        memoryStorage eeprom;
+        warmStartState state;
+        int peaks[PEAK_BUFFER_LEN];
+        before.getPeaks(peaks);
+        state.gainPot = REPLAY_GAIN_POT;
+        state.potentiometerValue = 0;
+        for (int ii = 0; ii < PEAK_BUFFER_LEN; ii++) {
+            state.peaks[ii] = peaks[ii];
+        }
+        firstWrites += saveWarmStart(eeprom, state);
+        unchangedWrites += saveWarmStart(eeprom, state);
+        bool loaded = loadWarmStart(eeprom, REPLAY_GAIN_POT, state);
+        loadedCount += loaded;
+
+        // a beat in the first RESTART_SETTLE samples was already on its upstroke at the restart, neither
+        // start sees all of it, so it is left out of the comparison
+        size_t settled = restart + RESTART_SETTLE;
+        std::vector<int> expected;
+        for (size_t ii = 0; ii < reference.size(); ii++) {
+            if (reference[ii] >= (int)settled && reference[ii] < (int)end) {
+                expected.push_back(reference[ii]);
+            }
+        }
+        expectedTotal += expected.size();
+        for (int warm = 0; warm < 2; warm++) {
+            lowPassFilter restartFilt;
+            slopeSumFilter restartSsf;
+            peakDetect detector(false);
+            if (warm && loaded) {
+                for (int ii = 0; ii < PEAK_BUFFER_LEN; ii++) {
+                    peaks[ii] = state.peaks[ii];
+                }
+                detector.seedPeaks(peaks);
+            }
+            std::vector<int> beats;
+            for (size_t ii = restart; ii < end; ii++) {
+                if (detector.isPeak(restartSsf.step(restartFilt.step(samples[ii]))) && ii >= settled) {
+                    beats.push_back(ii);
+                }
+            }
+            matchStats m = matchBeats(beats, expected);
+            matched[warm] += m.matched;
+            extra[warm] += m.extra;
+        }
+    }
+    printf("%d restarts: warm start state loaded %d times, %d EEPROM bytes written, %d on an unchanged save\n",
+           RESTART_COUNT, loadedCount, firstWrites, unchangedWrites);
+    for (int warm = 0; warm < 2; warm++) {
+        printf("  %s start: matched %d/%d peakDetect beats in the first %d s (missed %d, extra %d)\n",
+               warm ? "warm" : "cold", matched[warm], expectedTotal, RESTART_WINDOW, expectedTotal - matched[warm],
+               extra[warm]);
+    }
+    return matched[1] >= matched[0] && extra[1] <= extra[0];
+}
+
+template <class Detector>
+static bool checkGap(const char* name, const std::vector<int>& ssf, const size_t gapEnd) {
+    // returns false if the detector reports two beats closer than the refractory period
+    Detector detector;
+    int beatsAfter = 0;
+    int closest = -1;
+    long last = -1;
+    for (size_t ii = 0; ii < ssf.size(); ii++) {
+        if (detector.isPeak(ssf[ii])) {
+            if (last >= 0 && (closest < 0 || (long)ii - last < closest)) {
+                closest = ii - last;
+            }
+            last = ii;
+            beatsAfter += ii >= gapEnd;
+        }
+    }
+    printf("  %-20s %d beats after the gap, closest beats %d samples apart\n", name, beatsAfter, closest);
+    return closest < 0 || closest > config.active().refractoryPeriod;
+}
+
+static bool runGap(const std::vector<int>& samples) {
+    // the signal goes flat for GAP_LEN seconds (a disconnected sensor), long enough for the detectors to
+    // reset their thresholds and the template detector to relearn, and then the recording carries on
+    size_t gapStart = samples.size() / 4;
+    size_t gapLen = GAP_LEN * 1000 / SAMPLING_PERIOD;
+    std::vector<int> gapped(samples.begin(), samples.begin() + gapStart);
+    gapped.insert(gapped.end(), gapLen, samples[gapStart]);
+    gapped.insert(gapped.end(), samples.begin() + gapStart, samples.end());
+    double ns;
+    std::vector<int> ssf = filterSamples(gapped, ns);
+    printf("%d s flat gap at sample %zu:\n", GAP_LEN, gapStart);
+    bool ok = checkGap<peakDetect>("peakDetect", ssf, gapStart + gapLen);
+    return checkGap<templateMatchDetect>("templateMatchDetect", ssf, gapStart + gapLen) && ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: detector-replay recording.log\n");
+        return 1;
+    }
+    recording rec;
+    if (!loadRecording(argv[1], rec) || rec.samples.empty()) {
+        fprintf(stderr, "could not read %s\n", argv[1]);
+        return 1;
+    }
+
+    double sampleNs, blockNs;
+    std::vector<int> ssfVals = filterBlocks(rec.samples, blockNs);
+    bool identical = ssfVals == filterSamples(rec.samples, sampleNs);
+    printf("%zu samples, %zu triggers in log\n", rec.samples.size(), rec.triggers.size());
+    printf("filters: %.1f ns/sample per sample, %.1f ns/sample in blocks of %d, %s\n", sampleNs, blockNs,
+           REPLAY_BLOCK_LEN, identical ? "identical" : "MISMATCH");
+
+    result reference = run<peakDetect>(ssfVals);
+    report("peakDetect", reference, reference, rec);
+    result blocks = runBlocks(ssfVals);
+    report("peakDetect (blocks)", blocks, reference, rec);
+    std::vector<traceRecord> traceRef = collectTrace(ssfVals, false);
+    bool traceIdentical = sameTrace(traceRef, collectTrace(ssfVals, true));
+    printf("detector trace: %zu records, block API %s\n", traceRef.size(), traceIdentical ? "identical" : "MISMATCH");
+    report("templateMatchDetect", run<templateMatchDetect>(ssfVals), reference, rec);
+    report("peakDetect gated by signal quality", runQuality(rec.samples, ssfVals, reference.beats), reference, rec);
+    runScheduler(rec.samples, reference.beats);
+    bool gapOk = runGap(rec.samples);
+    bool warmOk = runRestart(rec.samples, reference.beats);
+    if (!identical || blocks.beats != reference.beats || !traceIdentical) {
+        fprintf(stderr, "block API does not match the per-sample API\n");
+        return 1;
+    }
+    if (!gapOk) {
+        fprintf(stderr, "beats closer together than the refractory period after a gap\n");
+        return 1;
+    }
+    if (!warmOk) {
+        fprintf(stderr, "warm start does worse than a cold start\n");
+        return 1;
+    }
+    return 0;
+}
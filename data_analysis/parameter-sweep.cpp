@@ -0,0 +1,117 @@
+/*
+ Sweeps the peak detector's parameters over a recorded signal, BANK_LANES parameter
+ sets per pass, and scores every set against the triggers recorded in the log.
+
+ build:
+    g++ -std=c++11 -O2 -mavx2 -I../pressure_trigger_module -o parameter-sweep parameter-sweep.cpp
+ (leave out -mavx2 for SSE2, or add -DDETECTOR_BANK_SCALAR for the plain C++ version)
+
+ usage:
+    parameter-sweep recording.log > sweep.txt
+
+ Every lane is also run through a scalar peakDetect, with the lane's parameters set
+ through the runtime config, and must give identical peaks.
+*/
+
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+
+#include "PressurePeakDetect.h"
+#include "DetectorBank.h"
+#include "Recording.h"
+
+const int SWEEP_THRESHOLD_SCALES[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18};
+const int SWEEP_REFRACTORY_PERIODS[] = {20, 30, 40, 50, 60, 75};
+const int SWEEP_RESET_PERIODS[] = {625, 1250};
+
+template <class T, size_t N>
+static int count(const T (&)[N]) {
+    return N;
+}
+
+static void setParams(const detectorParams& p) {
+    // the reset period is set last, or shortening both could be refused for a reset period shorter than
+    // the old refractory period
+    const char* error = config.set("refractory_period", p.refractoryPeriod);
+    config.swap();
+    error = error ? error : config.set("threshold_scale", p.thresholdScale);
+    config.swap();
+    error = error ? error : config.set("threshold_reset_period", p.thresholdResetPeriod);
+    config.swap();
+    if (error) {
+        fprintf(stderr, "can't set %d %d %d: %s\n", p.thresholdScale, p.refractoryPeriod, p.thresholdResetPeriod,
+                error);
+    }
+}
+
+static std::vector<int> scalarPeaks(const std::vector<int>& samples, const detectorParams& p) {
+    lowPassFilter filt;
+    slopeSumFilter ssf;
+    peakDetect detector(false);
+    std::vector<int> peaks;
+    setParams(p);
+    for (size_t ii = 0; ii < samples.size(); ii++) {
+        if (detector.isPeak(ssf.step(filt.step(samples[ii])))) {
+            peaks.push_back(ii);
+        }
+    }
+    detectorParams defaults = {THRESHOLD_SCALE, REFRACTORY_PERIOD, THRESHOLD_RESET_PERIOD};
+    setParams(defaults);
+    return peaks;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: parameter-sweep recording.log\n");
+        return 1;
+    }
+    recording rec;
+    if (!loadRecording(argv[1], rec) || rec.samples.empty()) {
+        fprintf(stderr, "could not read %s\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<detectorParams> params;
+    for (int ii = 0; ii < count(SWEEP_RESET_PERIODS); ii++) {
+        for (int jj = 0; jj < count(SWEEP_REFRACTORY_PERIODS); jj++) {
+            for (int kk = 0; kk < count(SWEEP_THRESHOLD_SCALES); kk++) {
+                detectorParams p = {SWEEP_THRESHOLD_SCALES[kk], SWEEP_REFRACTORY_PERIODS[jj], SWEEP_RESET_PERIODS[ii]};
+                params.push_back(p);
+            }
+        }
+    }
+
+    printf("# %zu samples, %zu triggers in log\n", rec.samples.size(), rec.triggers.size());
+    printf("threshold_scale refractory_period reset_period beats matched missed extra latency_ms\n");
+    int mismatches = 0;
+    double elapsedNs = 0;
+    for (size_t first = 0; first < params.size(); first += BANK_LANES) {
+        int lanes = params.size() - first < (size_t)BANK_LANES ? params.size() - first : BANK_LANES;
+        detectorBank bank(&params[first], lanes);
+        std::vector<std::vector<int> > peaks(lanes);
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t ii = 0; ii < rec.samples.size(); ii++) {
+            for (uint32_t mask = bank.step(rec.samples[ii]); mask; mask &= mask - 1) {
+                peaks[__builtin_ctz(mask)].push_back(ii);
+            }
+        }
+        elapsedNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        for (int lane = 0; lane < lanes; lane++) {
+            const detectorParams& p = params[first + lane];
+            matchStats m = matchBeats(peaks[lane], rec.triggers);
+            printf("%d %d %d %zu %d %d %d %.2f\n", p.thresholdScale, p.refractoryPeriod, p.thresholdResetPeriod,
+                   peaks[lane].size(), m.matched, m.missed, m.extra, m.latencyMs);
+            if (peaks[lane] != scalarPeaks(rec.samples, p)) {
+                fprintf(stderr, "lane with parameters %d %d %d does not match peakDetect\n", p.thresholdScale,
+                        p.refractoryPeriod, p.thresholdResetPeriod);
+                mismatches++;
+            }
+        }
+    }
+    fprintf(stderr, "%zu parameter sets, %.2f ns per sample per parameter set\n", params.size(),
+            elapsedNs / rec.samples.size() / params.size());
+    return mismatches ? 1 : 0;
+}
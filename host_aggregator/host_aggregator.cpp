@@ -0,0 +1,621 @@
+/*
+ Multi-unit host aggregator for the pressure trigger module.
+
+ Replaces one realtimePlot instance per scanner suite with a single process that
+ services any number of triggering units from one epoll event loop. For each unit
+ it decodes the telemetry lines, writes them to a log file and fans them out to
+ the clients connected to a unix socket, so local monitors share one view of
+ every unit without touching the serial ports themselves.
+
+ build (Linux only):
+    g++ -std=c++11 -O2 -Wall -o host_aggregator host_aggregator.cpp
+
+ usage:
+    host_aggregator [-s socket_path] [-l log_dir] device [device ...]
+
+ Each line sent to socket clients is prefixed with the index of the unit it came
+ from, in the order the devices were given on the command line:
+    <unit> <sample> <trigger>     telemetry sample, same fields as the serial stream
+    <unit> <tag> ...              any other line the unit sends, passed through as-is
+ A client can send "STATS" to receive one line of counters per unit.
+
+ To try it without hardware, replay_pty.py creates pseudo-terminals that play back
+ a recorded log at the unit's telemetry rate.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+const int SERIAL_BAUDRATE = B115200; // must match Serial.begin in the firmware
+const int SAMPLE_SEND_INTERVAL_US = 16000; // the firmware sends every 4th 4 ms sample
+const int STALL_INTERVAL_US = 4 * SAMPLE_SEND_INTERVAL_US; // longer gaps than this are counted as stalls
+const int STATS_PERIOD_S = 10; // counters are printed to stderr this often
+const size_t MAX_LINE_LEN = 256; // longer lines are discarded as garbage
+const size_t MAX_CLIENTS = 32;
+const int CLIENT_SEND_BUFFER = 1 << 20; // bytes
+// bytes held for a client whose socket is full, beyond this whole batches are dropped
+const size_t CLIENT_PENDING_MAX = 1 << 16;
+const int MAX_EVENTS = 64;
+
+// epoll user data is the index into this tagged space
+const uint64_t TAG_DEVICE = 1ull << 32;
+const uint64_t TAG_CLIENT = 2ull << 32;
+const uint64_t TAG_LISTEN = 3ull << 32;
+const uint64_t TAG_TIMER = 4ull << 32;
+const uint64_t TAG_SIGNAL = 5ull << 32;
+
+volatile sig_atomic_t running = 1;
+
+static uint64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct deviceCounters {
+    uint64_t bytes = 0;
+    uint64_t lines = 0;
+    uint64_t samples = 0;
+    uint64_t triggers = 0; // trigger pulses, not samples with the trigger high
+    uint64_t parseErrors = 0; // malformed or oversized lines
+    uint64_t clientDrops = 0; // batches of lines not delivered because a client fell too far behind
+    uint64_t stalls = 0; // gaps between samples longer than STALL_INTERVAL_US
+    uint64_t reconnects = 0;
+    uint64_t maxGapUs = 0;
+    // latency from the read() that completed a line to the line being logged and fanned out
+    uint64_t latencySumUs = 0;
+    uint64_t latencyMaxUs = 0;
+};
+
+struct device {
+    std::string path;
+    int fd = -1;
+    FILE* log = NULL;
+    std::string line; // partially received line
+    bool discarding = false; // set when the current line overflowed MAX_LINE_LEN
+    uint64_t lastSampleUs = 0;
+    bool lastTrigger = false; // trigger flag of the last sample, a pulse spans several samples
+    deviceCounters counters;
+};
+
+struct client {
+    int fd = -1;
+    std::string command; // partially received command
+    std::string pending; // output the socket hasn't taken yet, always ends on a line boundary
+};
+
+class aggregator {
+public:
+    aggregator(const std::vector<std::string>& paths, const std::string& socketPath, const std::string& logDir)
+        : socketPath(socketPath), logDir(logDir) {
+        devices.resize(paths.size());
+        for (size_t ii = 0; ii < paths.size(); ii++) {
+            devices[ii].path = paths[ii];
+        }
+    }
+
+    ~aggregator() {
+        for (size_t ii = 0; ii < devices.size(); ii++) {
+            closeDevice(devices[ii]);
+            if (devices[ii].log) {
+                fclose(devices[ii].log);
+            }
+        }
+        for (size_t ii = 0; ii < clients.size(); ii++) {
+            if (clients[ii].fd >= 0) {
+                close(clients[ii].fd);
+            }
+        }
+        if (listenFd >= 0) {
+            close(listenFd);
+            unlink(socketPath.c_str());
+        }
+        if (timerFd >= 0) {
+            close(timerFd);
+        }
+        if (signalFd >= 0) {
+            close(signalFd);
+        }
+        if (epollFd >= 0) {
+            close(epollFd);
+        }
+    }
+
+    bool setup() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            perror("epoll_create1");
+            return false;
+        }
+        if (!openLogs() || !openListenSocket() || !openTimer() || !openSignals()) {
+            return false;
+        }
+        for (size_t ii = 0; ii < devices.size(); ii++) {
+            openDevice(ii); // units that aren't plugged in yet are retried by the timer
+        }
+        return true;
+    }
+
+    void run() {
+        struct epoll_event events[MAX_EVENTS];
+        while (running) {
+            int n = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                perror("epoll_wait");
+                return;
+            }
+            uint64_t wakeUs = nowUs();
+            for (int ii = 0; ii < n; ii++) {
+                uint64_t tag = events[ii].data.u64 & ~0xffffffffull;
+                uint32_t index = (uint32_t)events[ii].data.u64;
+                if (tag == TAG_DEVICE) {
+                    readDevice(index, wakeUs);
+                } else if (tag == TAG_CLIENT) {
+                    if (events[ii].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                        readClient(index);
+                    }
+                    if ((events[ii].events & EPOLLOUT) && clients[index].fd >= 0) {
+                        flushClient(index);
+                    }
+                } else if (tag == TAG_LISTEN) {
+                    acceptClient();
+                } else if (tag == TAG_TIMER) {
+                    onTimer();
+                } else if (tag == TAG_SIGNAL) {
+                    running = 0;
+                }
+            }
+        }
+        printStats(stderr);
+    }
+
+private:
+    std::vector<device> devices;
+    std::vector<client> clients;
+    std::string socketPath;
+    std::string logDir;
+    int epollFd = -1;
+    int listenFd = -1;
+    int timerFd = -1;
+    int signalFd = -1;
+
+    bool watch(const int fd, const uint64_t data) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = data;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return false;
+        }
+        return true;
+    }
+
+    bool openLogs() {
+        mkdir(logDir.c_str(), 0755);
+        for (size_t ii = 0; ii < devices.size(); ii++) {
+            std::string name = logDir + "/unit" + std::to_string(ii) + ".log";
+            devices[ii].log = fopen(name.c_str(), "a");
+            if (!devices[ii].log) {
+                perror(name.c_str());
+                return false;
+            }
+            fprintf(devices[ii].log, "# %s\n", devices[ii].path.c_str());
+        }
+        return true;
+    }
+
+    bool openListenSocket() {
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            perror("socket");
+            return false;
+        }
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "socket path too long: %s\n", socketPath.c_str());
+            return false;
+        }
+        strcpy(addr.sun_path, socketPath.c_str());
+        unlink(socketPath.c_str()); // left behind if a previous instance was killed
+        if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 8) < 0) {
+            perror(socketPath.c_str());
+            return false;
+        }
+        return watch(listenFd, TAG_LISTEN);
+    }
+
+    bool openTimer() {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerFd < 0) {
+            perror("timerfd_create");
+            return false;
+        }
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = STATS_PERIOD_S;
+        spec.it_interval.tv_sec = STATS_PERIOD_S;
+        timerfd_settime(timerFd, 0, &spec, NULL);
+        return watch(timerFd, TAG_TIMER);
+    }
+
+    bool openSignals() {
+        // a self-pipe lets SIGINT/SIGTERM wake epoll_wait and shut down cleanly
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            perror("pipe2");
+            return false;
+        }
+        signalFd = fds[0];
+        signalPipeWrite() = fds[1];
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = onSignal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN); // clients that disconnect are handled through write() errors
+        return watch(signalFd, TAG_SIGNAL);
+    }
+
+    static int& signalPipeWrite() {
+        static int fd = -1;
+        return fd;
+    }
+
+    static void onSignal(int) {
+        char c = 0;
+        if (write(signalPipeWrite(), &c, 1) < 0) {
+            running = 0;
+        }
+    }
+
+    void openDevice(const size_t index) {
+        device& d = devices[index];
+        d.fd = open(d.path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (d.fd < 0) {
+            return;
+        }
+        struct termios tio;
+        if (tcgetattr(d.fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            cfsetispeed(&tio, SERIAL_BAUDRATE);
+            cfsetospeed(&tio, SERIAL_BAUDRATE);
+            tcsetattr(d.fd, TCSANOW, &tio);
+        }
+        d.line.clear();
+        d.discarding = false;
+        d.lastSampleUs = 0;
+        d.lastTrigger = false;
+        if (!watch(d.fd, TAG_DEVICE | index)) {
+            closeDevice(d);
+        }
+    }
+
+    void closeDevice(device& d) {
+        if (d.fd >= 0) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, d.fd, NULL);
+            close(d.fd);
+            d.fd = -1;
+        }
+    }
+
+    void readDevice(const size_t index, const uint64_t wakeUs) {
+        device& d = devices[index];
+        char buff[4096];
+        ssize_t n = read(d.fd, buff, sizeof(buff));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            // unplugged, or the far end of a pseudo-terminal closed
+            fprintf(stderr, "unit %zu (%s) disconnected\n", index, d.path.c_str());
+            closeDevice(d);
+            return;
+        }
+        d.counters.bytes += n;
+        // everything decoded from one read is logged and sent to the clients as one batch
+        std::string out;
+        uint64_t batchLines = 0;
+        char timestamp[64];
+        formatTimestamp(timestamp, sizeof(timestamp));
+        for (ssize_t ii = 0; ii < n; ii++) {
+            char c = buff[ii];
+            if (c == '\r') {
+                continue;
+            }
+            if (c != '\n') {
+                if (d.line.size() < MAX_LINE_LEN) {
+                    d.line.push_back(c);
+                } else {
+                    d.discarding = true;
+                }
+                continue;
+            }
+            if (d.discarding) {
+                d.counters.parseErrors++;
+            } else if (!d.line.empty() && decodeLine(index, d.line, wakeUs, out)) {
+                fprintf(d.log, "%s: %s\n", timestamp, d.line.c_str());
+                batchLines++;
+            }
+            d.line.clear();
+            d.discarding = false;
+        }
+        if (batchLines == 0) {
+            return;
+        }
+        broadcast(index, out);
+
+        uint64_t latency = nowUs() - wakeUs;
+        d.counters.latencySumUs += latency * batchLines;
+        if (latency > d.counters.latencyMaxUs) {
+            d.counters.latencyMaxUs = latency;
+        }
+    }
+
+    bool decodeLine(const size_t index, const std::string& line, const uint64_t wakeUs, std::string& out) {
+        device& d = devices[index];
+        d.counters.lines++;
+
+        char buff[MAX_LINE_LEN + 32];
+        int sample, trigger;
+        char extra;
+        if (sscanf(line.c_str(), "%d %d %c", &sample, &trigger, &extra) == 2) {
+            d.counters.samples++;
+            if (trigger && !d.lastTrigger) {
+                d.counters.triggers++;
+            }
+            d.lastTrigger = trigger != 0;
+            if (d.lastSampleUs) {
+                uint64_t gap = wakeUs - d.lastSampleUs;
+                if (gap > d.counters.maxGapUs) {
+                    d.counters.maxGapUs = gap;
+                }
+                if (gap > STALL_INTERVAL_US) {
+                    d.counters.stalls++;
+                }
+            }
+            d.lastSampleUs = wakeUs;
+            snprintf(buff, sizeof(buff), "%zu %d %d\n", index, sample, trigger);
+        } else if (line[0] >= 'A' && line[0] <= 'Z') {
+            // tagged records from the firmware are passed through untouched
+            snprintf(buff, sizeof(buff), "%zu %s\n", index, line.c_str());
+        } else {
+            d.counters.parseErrors++;
+            return false;
+        }
+        out += buff;
+        return true;
+    }
+
+    void broadcast(const size_t index, const std::string& out) {
+        for (size_t ii = 0; ii < clients.size(); ii++) {
+            if (clients[ii].fd >= 0 && !sendClient(ii, out)) {
+                devices[index].counters.clientDrops++;
+            }
+        }
+    }
+
+    bool sendClient(const size_t slot, const std::string& out) {
+        // sends a batch of whole lines, or queues it behind the output the client hasn't taken yet
+        // a slow client never stalls the event loop: once it is CLIENT_PENDING_MAX behind, whole batches
+        // are dropped, so it misses lines but never sees one cut short; returns false if out was dropped
+        client& c = clients[slot];
+        if (!c.pending.empty()) {
+            if (c.pending.size() + out.size() > CLIENT_PENDING_MAX) {
+                return false;
+            }
+            c.pending += out;
+            return true;
+        }
+        ssize_t n = send(c.fd, out.data(), out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            dropClient(slot);
+            return true;
+        }
+        size_t sent = n > 0 ? n : 0;
+        if (sent < out.size()) {
+            // the rest goes out when the socket has room again
+            c.pending.assign(out, sent, std::string::npos);
+            pollOutput(slot, true);
+        }
+        return true;
+    }
+
+    void flushClient(const size_t slot) {
+        client& c = clients[slot];
+        ssize_t n = send(c.fd, c.pending.data(), c.pending.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            dropClient(slot);
+            return;
+        }
+        if (n > 0) {
+            c.pending.erase(0, n);
+        }
+        if (c.pending.empty()) {
+            pollOutput(slot, false);
+        }
+    }
+
+    void pollOutput(const size_t slot, const bool enable) {
+        // EPOLLOUT is only watched while there is pending output, otherwise it would fire on every wait
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = enable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.u64 = TAG_CLIENT | slot;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, clients[slot].fd, &ev);
+    }
+
+    static void formatTimestamp(char* buff, const size_t len) {
+        // the realtimePlot log format, with the seconds field that realtimePlot leaves out
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        struct tm local;
+        localtime_r(&ts.tv_sec, &local);
+        size_t n = strftime(buff, len, "%Y-%m-%d-%H-%M-%S", &local);
+        snprintf(buff + n, len - n, "-%06ld", (long)(ts.tv_nsec / 1000));
+    }
+
+    void acceptClient() {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        size_t slot = clients.size();
+        for (size_t ii = 0; ii < clients.size(); ii++) {
+            if (clients[ii].fd < 0) {
+                slot = ii;
+                break;
+            }
+        }
+        if (slot == MAX_CLIENTS) {
+            close(fd);
+            return;
+        }
+        if (slot == clients.size()) {
+            clients.push_back(client());
+        }
+        // room for a few seconds of every unit's telemetry, so a briefly busy client doesn't miss data
+        int sendBuffer = CLIENT_SEND_BUFFER;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+        clients[slot].fd = fd;
+        clients[slot].command.clear();
+        clients[slot].pending.clear();
+        if (!watch(fd, TAG_CLIENT | slot)) {
+            dropClient(slot);
+        }
+    }
+
+    void dropClient(const size_t slot) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, clients[slot].fd, NULL);
+        close(clients[slot].fd);
+        clients[slot].fd = -1;
+    }
+
+    void readClient(const size_t slot) {
+        client& c = clients[slot];
+        char buff[256];
+        ssize_t n = recv(c.fd, buff, sizeof(buff), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (n <= 0) {
+            dropClient(slot);
+            return;
+        }
+        for (ssize_t ii = 0; ii < n; ii++) {
+            if (buff[ii] == '\r') {
+                continue;
+            }
+            if (buff[ii] != '\n') {
+                if (c.command.size() < MAX_LINE_LEN) {
+                    c.command.push_back(buff[ii]);
+                }
+                continue;
+            }
+            if (c.command == "STATS") {
+                sendClient(slot, formatStats());
+                if (c.fd < 0) {
+                    return;
+                }
+            }
+            c.command.clear();
+        }
+    }
+
+    void onTimer() {
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+            return;
+        }
+        for (size_t ii = 0; ii < devices.size(); ii++) {
+            if (devices[ii].fd < 0) {
+                openDevice(ii);
+                if (devices[ii].fd >= 0) {
+                    devices[ii].counters.reconnects++;
+                }
+            }
+            fflush(devices[ii].log);
+        }
+        printStats(stderr);
+    }
+
+    std::string formatStats() {
+        std::string stats;
+        for (size_t ii = 0; ii < devices.size(); ii++) {
+            const deviceCounters& c = devices[ii].counters;
+            char line[512];
+            snprintf(line, sizeof(line),
+                     "STATS %zu %s connected=%d bytes=%llu lines=%llu samples=%llu triggers=%llu "
+                     "parse_errors=%llu client_drops=%llu stalls=%llu reconnects=%llu max_gap_us=%llu "
+                     "latency_mean_us=%llu latency_max_us=%llu\n",
+                     ii, devices[ii].path.c_str(), devices[ii].fd >= 0,
+                     (unsigned long long)c.bytes, (unsigned long long)c.lines,
+                     (unsigned long long)c.samples, (unsigned long long)c.triggers,
+                     (unsigned long long)c.parseErrors, (unsigned long long)c.clientDrops,
+                     (unsigned long long)c.stalls, (unsigned long long)c.reconnects,
+                     (unsigned long long)c.maxGapUs,
+                     (unsigned long long)(c.lines ? c.latencySumUs / c.lines : 0),
+                     (unsigned long long)c.latencyMaxUs);
+            stats += line;
+        }
+        return stats;
+    }
+
+    void printStats(FILE* f) {
+        std::string stats = formatStats();
+        fputs(stats.c_str(), f);
+    }
+};
+
+static void usage() {
+    fprintf(stderr, "usage: host_aggregator [-s socket_path] [-l log_dir] device [device ...]\n");
+}
+
+int main(int argc, char** argv) {
+    std::string socketPath = "/tmp/bp_triggering.sock";
+    std::string logDir = "logs";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:h")) != -1) {
+        if (opt == 's') {
+            socketPath = optarg;
+        } else if (opt == 'l') {
+            logDir = optarg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    std::vector<std::string> paths(argv + optind, argv + argc);
+    aggregator agg(paths, socketPath, logDir);
+    if (!agg.setup()) {
+        return 1;
+    }
+    agg.run();
+    return 0;
+}
@@ -0,0 +1,72 @@
+"""Play a recorded log back through pseudo-terminals, imitating N triggering units.
+
+Each pseudo-terminal sends the recording in the firmware's telemetry format
+("<sample> <trigger>" every 16 ms), starting at a different offset so the units
+aren't in lock step. Point host_aggregator at the printed device paths.
+
+usage:
+    python replay_pty.py N recording.log
+
+The recording can be a realtimePlot log (volts, trigger marker > 0) such as
+data_analysis/yorkshire-pig-trial1.log, or a log written by blackbox-dump.py.
+Linux/OSX only.
+"""
+from __future__ import division
+
+import os
+import sys
+import time
+import tty
+
+SIXTEEN_BIT_TO_COUNTS = 19859 # must match realtimePlot.py
+SAMPLE_SEND_INTERVAL = 0.016 # seconds, the firmware sends every 4th 4 ms sample
+
+
+def load_recording(path):
+    lines = []
+    with open(path) as f:
+        header = f.readline().split()
+        for row in f:
+            row = row.split()
+            if not row or row[0].startswith('#'):
+                continue
+            if header[0] == 'sample': # blackbox-dump.py: sample time adc_counts trigger pot_code
+                lines.append("{} {}\n".format(int(row[2]), int(row[3])))
+            else: # realtimePlot: time volts trigger_marker
+                sample = int(float(row[1]) * SIXTEEN_BIT_TO_COUNTS)
+                lines.append("{} {}\n".format(sample, int(float(row[2]) > 0)))
+    return [line.encode('ascii') for line in lines]
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(1)
+
+    n_units = int(sys.argv[1])
+    recording = load_recording(sys.argv[2])
+
+    masters = []
+    for ii in range(n_units):
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        print(os.ttyname(slave))
+        masters.append(master)
+    sys.stdout.flush()
+
+    offsets = [ii * len(recording) // n_units for ii in range(n_units)]
+    start = time.time()
+    count = 0
+    try:
+        while True:
+            for master, offset in zip(masters, offsets):
+                try:
+                    os.write(master, recording[(offset + count) % len(recording)])
+                except OSError:
+                    pass # nobody has the device open, the data is dropped like on a real unit
+            count += 1
+            delay = start + count * SAMPLE_SEND_INTERVAL - time.time()
+            if delay > 0:
+                time.sleep(delay)
+    except KeyboardInterrupt:
+        pass
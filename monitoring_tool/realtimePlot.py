@@ -89,6 +89,12 @@ logger.setLevel(logging.INFO)
 handler = logging.handlers.RotatingFileHandler(log_filename, backupCount=200)
 logger.addHandler(handler)
 
+def show_beat_statistics(serial_line):
+    """display the per-beat record computed by the teensy: B rr hr hr_smoothed systolic diastolic rr_mean rr_variance"""
+    rr, hr, hr_smoothed, systolic, diastolic, rr_mean, rr_variance = [int(v) for v in serial_line.split()[1:]]
+    win_plot.statusBar().showMessage("HR {} bpm  RR {} ms (mean {} ms, SD {:.0f} ms)  BP {:.2f}/{:.2f} V".format(
+        hr_smoothed, rr, rr_mean, rr_variance ** 0.5, systolic / SIXTEEN_BIT_TO_COUNTS, diastolic / SIXTEEN_BIT_TO_COUNTS))
+
 def open_log_directory():
     os.startfile(log_dir) # only works on windows, but that's of little consequence
 
@@ -129,6 +135,12 @@ class Teensy(object):
         """read one line of data over serial and parse it"""
         try:
             serial_line = self.ser.readline()
+            if serial_line.startswith('B'):
+                show_beat_statistics(serial_line)
+                return None
+            if serial_line[:1].isalpha():
+                # other tagged records (signal quality...) are for the logging tools, not the plot
+                return None
             sampleval, trigger = serial_line.split()
             sampleval = int(sampleval)
             trigger = int(trigger)
@@ -25,6 +25,8 @@
 #define __AUTOGAINADJUST__
 
 #include "spi4teensy3.h"
+#include "DetectorTrace.h"
+#include "RuntimeConfig.h"
 
 // set pin 10 as the slave select for the digital pot:
 const int slaveSelectPin = 10;
@@ -36,9 +38,6 @@ volatile int GAIN_POT;
 const int MIN_SIGNAL_AMPLITUDE = 25000; // ~0.76 V from the noninverting amplifier
 const int TARGET_AMPLITUDE = 35000;
 const int MAX_SIGNAL_AMPLITUDE = 55000; // ~4.20 V from the noninverting amplifier
-// number of potentiomter codes to correct by if signal is out of range
-// a higher number results in a faster correction, at the risk of over-adjusting to short term amplitude spikes
-const int CORRECTION = 5;
 
 volatile int potentiometerValue = 0; // range 0-256 where 0 -> ~84 ohms and 256 -> ~50 k-ohms
 // if gain is being shifted up or down, this gives the stopping value
@@ -57,6 +56,18 @@ volatile bool targetExceeded = false;
 // starts in increasing state to ensure that the signal is amplified to an optimal level at startup
 volatile int seekState = 1;
 
+void setSeekState(const int newState) {
+    if (newState != seekState) {
+        trace.add(TRACE_SEEK_STATE, newState);
+    }
+    seekState = newState;
+}
+
+void changeTargetPotentiometerValue(const int change) {
+    targetPotentiometerValue += change;
+    trace.add(TRACE_GAIN_TARGET, targetPotentiometerValue);
+}
+
 void digitalPotWrite(const int address, int value) {
     // write the new potentiometer value to the digital pot chip through SPI
     // take the SS pin low to select the chip:
@@ -81,6 +92,15 @@ void setupGainAdjustment() {
     digitalPotWrite(GAIN_POT, 0); // start with unity gain to avoid clipping
 }
 
+void restoreGain(const int value) {
+    // warm start: resume at a gain saved by an earlier run instead of ramping up from unity gain
+    // the gain is still checked every window, so a changed setup is corrected as usual
+    potentiometerValue = value;
+    targetPotentiometerValue = value;
+    digitalPotWrite(GAIN_POT, value);
+    setSeekState(0);
+}
+
 // algorithm:
 // have minimum maximum and target signal threshold
 // during a 5 second window signal must exceed minimum and not exceed maximum
@@ -115,17 +135,19 @@ void adjustGain(const int sensor_value) {
     if (windowCount > WINDOW_PERIOD) {
         // check if min or max have been violated
         if (!minExceeded) {
-            seekState = 1;
+            setSeekState(1);
         }
         if (maxExceeded) {
-            seekState = 2;
+            setSeekState(2);
         }
         // if unit was increasing gain, check if the threshold magnitude was reached
+        // potentiometer codes to correct by, see CORRECTION
+        int correction = config.active().correction;
         if (seekState == 1) {
             if (targetExceeded) {
-                seekState = 0;
-            } else if (potentiometerValue <= 256 - CORRECTION) {
-                targetPotentiometerValue += CORRECTION;
+                setSeekState(0);
+            } else if (potentiometerValue <= 256 - correction) {
+                changeTargetPotentiometerValue(correction);
             }
             else {
                 return;
@@ -134,9 +156,9 @@ void adjustGain(const int sensor_value) {
         // if unit was decreasing gain, check if threshold reached
         if (seekState == 2) {
             if (!targetExceeded) {
-                seekState = 0;
-            } else if (potentiometerValue > 0 + CORRECTION) {
-                targetPotentiometerValue -= CORRECTION;
+                setSeekState(0);
+            } else if (potentiometerValue > 0 + correction) {
+                changeTargetPotentiometerValue(-correction);
             } else {
                 return;
             }
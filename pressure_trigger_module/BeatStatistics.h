@@ -0,0 +1,117 @@
+/*
+ Beat to beat statistics for the telemetry stream.
+
+ Keeps the RR interval, heart rate, systolic and diastolic pressure (in ADC counts)
+ and a running mean and variance of the RR interval, so the monitoring side can
+ show live vitals without filtering the waveform itself. Memory use is constant.
+
+ The per-sample update is two compares and an increment. Everything else runs once
+ per beat, and the only division is the heart rate (a single hardware divide on the
+ Cortex-M4). The running mean and variance are Welford's update with an exponential
+ weight of 1/2^RR_STATS_SHIFT instead of 1/n, so the statistics follow slow changes
+ in heart rate and never overflow.
+*/
+
+#ifndef __BEATSTATISTICS__
+#define __BEATSTATISTICS__
+
+#include <stdint.h>
+
+const int HR_SMOOTHING_SHIFT = 3; // each beat contributes 1/8 of the smoothed heart rate
+const int RR_STATS_SHIFT = 4; // ~16 beats of memory for the RR mean and variance
+const int BEAT_STATS_FRACTION_BITS = 8; // fixed point fraction bits of the running averages
+// longer intervals are a lost signal, not a heart beat; 3 s is 20 bpm
+const int MAX_RR_MS = 3000;
+
+struct beatRecord {
+    int rr; // ms
+    int hr; // bpm
+    int hrSmoothed; // bpm
+    int systolic; // ADC counts
+    int diastolic;
+    int rrMean; // ms
+    int rrVariance; // ms^2
+};
+
+class beatStatistics {
+public:
+    beatStatistics(const int samplePeriodMs) : samplePeriodMs(samplePeriodMs) {}
+private:
+    const int samplePeriodMs;
+    int samplesSinceBeat = 0;
+    bool haveBeat = false; // false until the first beat, which has no RR interval
+    bool haveStats = false;
+    int maxVal = 0;
+    int minVal = 0;
+
+    // fixed point, BEAT_STATS_FRACTION_BITS fraction bits
+    int hrSmoothed = 0;
+    int rrMean = 0; // samples
+    int64_t rrVariance = 0; // samples^2, 2 * BEAT_STATS_FRACTION_BITS fraction bits
+public:
+    // call for every sample with the raw ADC value
+    void step(const int sample) {
+        if (samplesSinceBeat == 0 || sample > maxVal) {
+            maxVal = sample;
+        }
+        if (samplesSinceBeat == 0 || sample < minVal) {
+            minVal = sample;
+        }
+        // anything this long is rejected anyway, the cap stops it overflowing
+        if (samplesSinceBeat < MAX_RR_MS / samplePeriodMs) {
+            samplesSinceBeat++;
+        }
+    }
+
+    // call when a beat is detected, returns true and fills in record when there is an RR interval to report
+    // unreliable beats (e.g. a low signal quality score) restart the interval but don't update the averages
+    bool beat(const bool reliable, beatRecord& record) {
+        int rr = samplesSinceBeat;
+        bool valid = haveBeat && reliable && rr > 0 && rr * samplePeriodMs < MAX_RR_MS;
+        if (valid) {
+            record.rr = rr * samplePeriodMs;
+            record.hr = 60000 / record.rr;
+            record.systolic = maxVal;
+            record.diastolic = minVal;
+            update(rr, record.hr);
+            record.hrSmoothed = round(hrSmoothed);
+            record.rrMean = round(rrMean * samplePeriodMs);
+            record.rrVariance = round(round(rrVariance * samplePeriodMs * samplePeriodMs));
+        }
+        haveBeat = reliable;
+        samplesSinceBeat = 0;
+        return valid;
+    }
+
+    // mean RR interval in ms, 0 until there has been a reliable interval
+    int meanRR() const {
+        return haveStats ? round(rrMean * samplePeriodMs) : 0;
+    }
+
+private:
+    static int round(const int64_t x) {
+        return (int)((x + (1 << (BEAT_STATS_FRACTION_BITS - 1))) >> BEAT_STATS_FRACTION_BITS);
+    }
+
+    void update(const int rr, const int hr) {
+        if (!haveStats) {
+            // start from the first interval rather than ramping up from zero
+            hrSmoothed = hr << BEAT_STATS_FRACTION_BITS;
+            rrMean = rr << BEAT_STATS_FRACTION_BITS;
+            rrVariance = 0;
+            haveStats = true;
+            return;
+        }
+        hrSmoothed += ((hr << BEAT_STATS_FRACTION_BITS) - hrSmoothed) >> HR_SMOOTHING_SHIFT;
+
+        // exponentially weighted Welford:
+        //   delta = x - mean, mean += delta * w, variance = (1 - w) * (variance + delta * delta * w)
+        int delta = (rr << BEAT_STATS_FRACTION_BITS) - rrMean;
+        int increment = delta >> RR_STATS_SHIFT;
+        rrMean += increment;
+        rrVariance += (int64_t)delta * increment;
+        rrVariance -= rrVariance >> RR_STATS_SHIFT;
+    }
+};
+
+#endif
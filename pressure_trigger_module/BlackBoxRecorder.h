@@ -0,0 +1,156 @@
+/*
+ Black box recorder for the pressure trigger module.
+
+ Keeps the most recent raw ADC samples, trigger events and gain changes in
+ RAM so that a study can be recovered after the monitoring tool or the host
+ computer crashes. The recorder is written to by the sampling interrupt, so
+ appending is kept to a masked store and an increment. The host requests the
+ contents by sending the DUMP command, which streams the buffers as raw binary
+ at full USB speed (see data_analysis/blackbox-dump.py for the reader).
+
+ Dump layout (little endian, no padding):
+  * blackBoxHeader
+  * sampleCount x uint16_t ADC samples, oldest first
+  * eventCount x blackBoxEvent, oldest first
+
+ The recorder only depends on stdint, so the same code runs in a host build.
+*/
+
+#ifndef __BLACKBOXRECORDER__
+#define __BLACKBOXRECORDER__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// both lengths must be powers of two so that wrapping is a single mask
+// 16384 samples x 4ms = ~65 seconds of history, 32 KB of the Teensy 3.1's 64 KB of RAM
+const uint32_t BLACKBOX_SAMPLE_LEN = 16384;
+const uint32_t BLACKBOX_EVENT_LEN = 512;
+const uint32_t BLACKBOX_MAGIC = 0x31584242; // "BBX1"
+
+// event types
+const uint16_t BLACKBOX_TRIGGER = 1; // value unused
+const uint16_t BLACKBOX_GAIN = 2;    // value is the new potentiometer code
+// value is the number of samples skipped during a dump, they follow the event's sample and repeat its value
+const uint16_t BLACKBOX_GAP = 3;
+
+struct blackBoxEvent {
+    uint32_t sampleIndex; // index of the last sample recorded before the event
+    uint16_t type;
+    uint16_t value;
+};
+
+struct blackBoxHeader {
+    uint32_t magic;
+    uint32_t samplePeriodUs;
+    uint32_t sampleHead; // total number of samples since startup, including those skipped during dumps
+    uint32_t sampleCount; // number of samples that follow the header
+    uint32_t eventHead;
+    uint32_t eventCount;
+};
+
+class blackBoxRecorder {
+public:
+    blackBoxRecorder(const uint32_t samplePeriodUs) : samplePeriodUs(samplePeriodUs) {}
+private:
+    uint16_t samples[BLACKBOX_SAMPLE_LEN];
+    blackBoxEvent events[BLACKBOX_EVENT_LEN];
+    const uint32_t samplePeriodUs;
+    volatile uint32_t sampleHead = 0;
+    volatile uint32_t eventHead = 0;
+    // set while a dump is in progress, the interrupt stops writing to the buffers so they can be streamed as-is
+    volatile bool frozen = false;
+    volatile uint32_t skippedSamples = 0;
+public:
+    void addSample(const uint16_t sample) {
+        if (frozen) {
+            // the index keeps counting, so samples and trace ticks after the dump keep their true time
+            skippedSamples++;
+            sampleHead++;
+            return;
+        }
+        if (skippedSamples) {
+            fillGap();
+        }
+        samples[sampleHead & (BLACKBOX_SAMPLE_LEN - 1)] = sample;
+        sampleHead++;
+    }
+
+    void addEvent(const uint16_t type, const uint16_t value) {
+        if (frozen) {
+            return;
+        }
+        blackBoxEvent& e = events[eventHead & (BLACKBOX_EVENT_LEN - 1)];
+        e.sampleIndex = sampleHead - 1;
+        e.type = type;
+        e.value = value;
+        eventHead++;
+    }
+
+    uint32_t lastSampleIndex() const {
+        return sampleHead - 1;
+    }
+
+    // Output must provide write(const uint8_t*, size_t), e.g. Serial on the Teensy
+    // must not be called from the sampling interrupt
+    template <class Output>
+    void dump(Output& out) {
+        frozen = true;
+        // samples skipped by a dump that ended before the interrupt could fill them in aren't in the buffer yet;
+        // while frozen the interrupt advances both counts together, read them until they're from the same sample
+        uint32_t skipped;
+        uint32_t head;
+        do {
+            skipped = skippedSamples;
+            head = sampleHead;
+        } while (skipped != skippedSamples);
+        head -= skipped;
+
+        blackBoxHeader header;
+        header.magic = BLACKBOX_MAGIC;
+        header.samplePeriodUs = samplePeriodUs;
+        header.sampleHead = head;
+        header.sampleCount = head < BLACKBOX_SAMPLE_LEN ? head : BLACKBOX_SAMPLE_LEN;
+        header.eventHead = eventHead;
+        header.eventCount = eventHead < BLACKBOX_EVENT_LEN ? eventHead : BLACKBOX_EVENT_LEN;
+        out.write((const uint8_t*)&header, sizeof(header));
+
+        writeRing(out, (const uint8_t*)samples, sizeof(samples[0]), BLACKBOX_SAMPLE_LEN,
+                  header.sampleHead, header.sampleCount);
+        writeRing(out, (const uint8_t*)events, sizeof(events[0]), BLACKBOX_EVENT_LEN,
+                  header.eventHead, header.eventCount);
+
+        frozen = false;
+    }
+
+private:
+    void fillGap() {
+        // the skipped samples repeat the last one recorded before the dump, the GAP event marks them
+        uint32_t first = sampleHead - skippedSamples;
+        uint16_t last = samples[(first - 1) & (BLACKBOX_SAMPLE_LEN - 1)];
+        uint32_t count = skippedSamples < BLACKBOX_SAMPLE_LEN ? skippedSamples : BLACKBOX_SAMPLE_LEN;
+        for (uint32_t ii = sampleHead - count; ii != sampleHead; ii++) {
+            samples[ii & (BLACKBOX_SAMPLE_LEN - 1)] = last;
+        }
+        blackBoxEvent& e = events[eventHead & (BLACKBOX_EVENT_LEN - 1)];
+        e.sampleIndex = first - 1;
+        e.type = BLACKBOX_GAP;
+        e.value = skippedSamples < UINT16_MAX ? skippedSamples : UINT16_MAX;
+        eventHead++;
+        skippedSamples = 0;
+    }
+
+    template <class Output>
+    static void writeRing(Output& out, const uint8_t* buff, const size_t itemSize, const uint32_t len,
+                          const uint32_t head, const uint32_t count) {
+        // write oldest to newest as at most two contiguous chunks
+        uint32_t first = (head - count) & (len - 1);
+        uint32_t firstChunk = len - first < count ? len - first : count;
+        out.write(buff + first * itemSize, firstChunk * itemSize);
+        if (count > firstChunk) {
+            out.write(buff, (count - firstChunk) * itemSize);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ Binary event trace of the detector and gain control state machines.
+
+ Every state transition (peak found, refractory period over, threshold update or
+ reset, gain seek state change...) is written as an 8 byte timestamped record into
+ a ring buffer by the sampling interrupt. The TRACE command drains the ring over
+ serial, and blackbox-dump.py draws the events on top of the black box waveform,
+ so a missed beat can be explained after the fact.
+
+ The interrupt is the only writer and the main loop the only reader. The writer
+ never waits: when the ring is full it overwrites the oldest record, and the reader
+ detects records that were overwritten while it was copying them.
+
+ Record layout (little endian): uint32_t (event << 24 | tick & 0xFFFFFF), int32_t value
+ where tick is the black box index of the sample being processed.
+ Dump layout: traceHeader, then count records, oldest first.
+*/
+
+#ifndef __DETECTORTRACE__
+#define __DETECTORTRACE__
+
+#include <stdint.h>
+
+const uint32_t TRACE_LEN = 256; // must be a power of two
+const uint32_t TRACE_MAGIC = 0x31435254; // "TRC1"
+const int TRACE_COPY_CHUNK = 32; // records copied out of the ring at a time
+
+// events, the meaning of value is given for each
+const uint8_t TRACE_OVERWRITTEN = 0;        // placeholder for a record lost while it was being read
+const uint8_t TRACE_PEAK = 1;               // peak found, refractory period starts; detector output at the peak
+const uint8_t TRACE_REFRACTORY_EXIT = 2;    // rising edge found after the refractory period; samples since the peak
+const uint8_t TRACE_THRESHOLD_UPDATE = 3;   // new peak threshold
+const uint8_t TRACE_THRESHOLD_RESET = 4;    // no peak for THRESHOLD_RESET_PERIOD samples; unused
+const uint8_t TRACE_SEEK_STATE = 5;         // gain seek state change; new seekState
+const uint8_t TRACE_GAIN_TARGET = 6;        // new target potentiometer code
+const uint8_t TRACE_TEMPLATE_LEARNED = 7;   // template matching detector has enough beats; number of beats
+const uint8_t TRACE_TEMPLATE_RESET = 8;     // template stopped matching, falling back to peakDetect; unused
+const uint8_t TRACE_BEAT_QUALITY = 9;       // beat scored by signalQuality; score | flags << 8
+const uint8_t TRACE_TRIGGER_DELAYED = 10;   // held trigger sent once the scanner was ready; samples held
+const uint8_t TRACE_TRIGGER_DROPPED = 11;   // trigger not sent because the scanner was busy; samples held
+
+struct traceRecord {
+    uint32_t eventTick;
+    int32_t value;
+};
+
+struct traceHeader {
+    uint32_t magic;
+    uint32_t tick; // tick at the time of the dump, for unwrapping the 24 bit record ticks
+    uint32_t lost; // records overwritten before they could be read, since the previous dump
+    uint32_t count;
+};
+
+class detectorTrace {
+private:
+    traceRecord records[TRACE_LEN];
+    volatile uint32_t head = 0; // only written by the interrupt
+    uint32_t tail = 0; // only used by the reader
+public:
+    volatile uint32_t tick = 0; // set by the sampling interrupt before the detectors run
+
+    void add(const uint8_t event, const int32_t value) {
+        uint32_t h = head;
+        traceRecord& r = records[h & (TRACE_LEN - 1)];
+        r.eventTick = ((uint32_t)event << 24) | (tick & 0xFFFFFF);
+        r.value = value;
+        __sync_synchronize(); // the record must be complete before the reader can see it
+        head = h + 1;
+    }
+
+    // Output must provide write(const uint8_t*, size_t), must not be called from the sampling interrupt
+    template <class Output>
+    void dump(Output& out) {
+        uint32_t h = head;
+        __sync_synchronize();
+        uint32_t lost = 0;
+        uint32_t start = tail;
+        if (h - start > TRACE_LEN) {
+            lost = h - start - TRACE_LEN;
+            start = h - TRACE_LEN;
+        }
+
+        traceHeader header;
+        header.magic = TRACE_MAGIC;
+        header.tick = tick;
+        header.lost = lost;
+        header.count = h - start;
+        out.write((const uint8_t*)&header, sizeof(header));
+
+        traceRecord chunk[TRACE_COPY_CHUNK];
+        for (uint32_t ii = start; ii != h;) {
+            uint32_t n = h - ii < (uint32_t)TRACE_COPY_CHUNK ? h - ii : TRACE_COPY_CHUNK;
+            for (uint32_t jj = 0; jj < n; jj++) {
+                chunk[jj] = records[(ii + jj) & (TRACE_LEN - 1)];
+            }
+            // anything the writer lapped during the copy may be torn, replace it with a placeholder
+            __sync_synchronize();
+            uint32_t oldestValid = head - TRACE_LEN;
+            for (uint32_t jj = 0; jj < n && (int32_t)(ii + jj - oldestValid) < 0; jj++) {
+                chunk[jj].eventTick = (uint32_t)TRACE_OVERWRITTEN << 24;
+                chunk[jj].value = 0;
+            }
+            out.write((const uint8_t*)chunk, n * sizeof(traceRecord));
+            ii += n;
+        }
+        tail = h;
+    }
+};
+
+detectorTrace trace;
+
+#endif
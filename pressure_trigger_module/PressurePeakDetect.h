@@ -1,15 +1,16 @@
 #ifndef __PRESSUREPEAKDETECTH__
 #define __PRESSUREPEAKDETECTH__
 
+#include "DetectorTrace.h"
+#include "RuntimeConfig.h"
+
 const int BUFFER_LEN = 15; // determines how many samples will be stored at a time
 const int PEAK_BUFFER_LEN = 5; // must be <= than BUFFER_LEN, determines how many peaks threshold average uses
-const int THRESHOLD_RESET_PERIOD = 1250; // reset magnitude thresholds after 5 seconds without heartbeat
 const int ROLLING_POINT_SPACING = 2; // must be < than BUFFER_LEN
 
-// # of samples to wait before searching for peaks again, determines maximum possible BPM
-// should be kept as short as possible, because many problems arise when refractory period approaches beat period
-const int REFRACTORY_PERIOD = 40;
-volatile int THRESHOLD_SCALE = 3 * PEAK_BUFFER_LEN / 2;
+// the block versions of the filters work through their input this many samples at a time
+// any block length can be passed in, the results are identical to calling the per-sample versions
+const int BLOCK_CHUNK_LEN = 64;
 
 class ringBuffer {
 // when buffer is full, oldest item is overwritten by the new item
@@ -52,13 +53,44 @@ class lowPassFilter {
 private:
     int x_n_1 = 0;
     int y_n_1 = 0;
+    bool primed = false;
+
+    void prime(const int x) {
+        // start in steady state at the first input, a step up from zero would look like a huge beat
+        x_n_1 = x;
+        y_n_1 = x;
+        primed = true;
+    }
 public:
     int step(int x_n) {
+        if (!primed) {
+            prime(x_n);
+        }
         int y_n = (x_n/20) + (x_n_1/20) + 9*y_n_1/10;
         x_n_1 = x_n;
         y_n_1 = y_n;
         return(y_n);
     }
+
+    void step(const int* x, int* y, const int n) {
+        // filters a block of n samples into y, the filter is recursive so this is a plain loop
+        // with the state kept in registers instead of reloaded for every sample
+        if (!primed && n > 0) {
+            prime(x[0]);
+        }
+        int x_1 = x_n_1 / 20;
+        int y_1 = y_n_1;
+        for (int ii = 0; ii < n; ii++) {
+            int x_0 = x[ii] / 20;
+            y_1 = x_0 + x_1 + 9*y_1/10;
+            x_1 = x_0;
+            y[ii] = y_1;
+        }
+        if (n > 0) {
+            x_n_1 = x[n - 1];
+            y_n_1 = y_1;
+        }
+    }
 };
 
 class slopeSumFilter {
@@ -70,8 +102,20 @@ public:
 private:
     volatile int slope_sum = 0;
     ringBuffer sampleBuffer; // filtered samples
+    bool primed = false;
+
+    void prime(const int x) {
+        // fill the buffer with the first input, so the filter doesn't see a slope from zero up to the signal
+        for (int ii = 0; ii < BUFFER_LEN; ii++) {
+            sampleBuffer.addSample(x);
+        }
+        primed = true;
+    }
 public:
     int step(const int x) {
+        if (!primed) {
+            prime(x);
+        }
         // implemented with a ring buffer for efficiency
         // calculation is equivalence to adding all of the positive slopes over the interval
         int old_slope = sampleBuffer[1] - sampleBuffer[0];
@@ -89,12 +133,52 @@ public:
         sampleBuffer.addSample(x);
         return slope_sum;
     }
+
+    void step(const int* x, int* y, const int n) {
+        // filters a block of n samples into y
+        // history holds the buffered samples followed by the current chunk of the block, so every slope
+        // can be computed up front in a loop without dependencies (which the compiler can vectorize),
+        // leaving only the running sum to be done sample by sample
+        int history[BUFFER_LEN + BLOCK_CHUNK_LEN];
+        int positiveSlopes[BUFFER_LEN + BLOCK_CHUNK_LEN - 1];
+        if (!primed && n > 0) {
+            prime(x[0]);
+        }
+        for (int ii = 0; ii < BUFFER_LEN; ii++) {
+            history[ii] = sampleBuffer[ii];
+        }
+        int sum = slope_sum;
+        for (int start = 0; start < n; start += BLOCK_CHUNK_LEN) {
+            int len = n - start < BLOCK_CHUNK_LEN ? n - start : BLOCK_CHUNK_LEN;
+            for (int ii = 0; ii < len; ii++) {
+                history[BUFFER_LEN + ii] = x[start + ii];
+            }
+            for (int ii = 0; ii < BUFFER_LEN + len - 1; ii++) {
+                int slope = history[ii + 1] - history[ii];
+                positiveSlopes[ii] = slope > 0 ? slope : 0;
+            }
+            for (int ii = 0; ii < len; ii++) {
+                // the slope leaving the window, and the slope added by the new sample
+                sum += positiveSlopes[ii + BUFFER_LEN - 1] - positiveSlopes[ii];
+                y[start + ii] = sum;
+            }
+            for (int ii = 0; ii < BUFFER_LEN; ii++) {
+                history[ii] = history[len + ii];
+            }
+        }
+        slope_sum = sum;
+        for (int ii = 0; ii < BUFFER_LEN; ii++) {
+            sampleBuffer.addSample(history[ii]);
+        }
+    }
 };
 
 class peakDetect {
 public:
-    peakDetect() {}
+    peakDetect(const bool traced = true) : traced(traced) {}
 private:
+    const bool traced; // whether state transitions are written to the detector trace
+
     ringBuffer sb; // ssf sample buffer
     ringBuffer pb; // peak buffer
 
@@ -114,18 +198,25 @@ public:
         // increasing ROLLING_POINT_SPACING lowers peak detection sensitivity, increases delay
         int lrs = sb[BUFFER_LEN - ROLLING_POINT_SPACING] + sb[BUFFER_LEN - ROLLING_POINT_SPACING -1];
         int rrs = sb[BUFFER_LEN - 1] + x;
+        const runtimeParams& params = config.active();
 
         if (rising_edge && lrs > rrs && lrs > peakThreshold) {
+            if (traced) {
+                trace.add(TRACE_PEAK, lrs);
+            }
             updatePeakThreshold(lrs);
             rising_edge = false;
             rp_counter = 0;
             return(true);
         }
         // enter rising_edge state if refractory period over, slope is trending upwards
-        if (!rising_edge && rp_counter > REFRACTORY_PERIOD && lrs < rrs) {
+        if (!rising_edge && rp_counter > params.refractoryPeriod && lrs < rrs) {
             rising_edge = true;
+            if (traced) {
+                trace.add(TRACE_REFRACTORY_EXIT, rp_counter);
+            }
         // reset the magnitude threshold if peaks are not being detected
-        } else if (rp_counter > THRESHOLD_RESET_PERIOD) {
+        } else if (rp_counter > params.thresholdResetPeriod) {
             rp_counter += 1;
             resetPeakThreshold();
         } else {
@@ -134,14 +225,103 @@ public:
         return(false);
     }
 
+    int findPeaks(const int* x, const int n, int* peakOffsets) {
+        // block version of isPeak, stores the offsets of the peaks found in x and returns how many there were
+        // gives identical results to calling isPeak on every sample, but only touches the object's
+        // state once per block (and once per peak)
+        // trace.tick must be the tick of x[0] on entry; each trace record gets the tick of its own sample, and
+        // trace.tick is left at the tick of x[n - 1], as if isPeak had been called with it advanced per sample
+        int history[BUFFER_LEN + BLOCK_CHUNK_LEN];
+        for (int ii = 0; ii < BUFFER_LEN; ii++) {
+            history[ii] = sb[ii];
+        }
+        bool rising = rising_edge;
+        int counter = rp_counter;
+        int threshold = peakThreshold;
+        const runtimeParams& params = config.active();
+        const uint32_t firstTick = trace.tick;
+        int peaks = 0;
+        for (int start = 0; start < n; start += BLOCK_CHUNK_LEN) {
+            int len = n - start < BLOCK_CHUNK_LEN ? n - start : BLOCK_CHUNK_LEN;
+            for (int ii = 0; ii < len; ii++) {
+                history[BUFFER_LEN + ii] = x[start + ii];
+            }
+            for (int ii = 0; ii < len; ii++) {
+                // after adding sample ii, sb[jj] is history[ii + 1 + jj]
+                const int* window = history + ii + 1;
+                int lrs = window[BUFFER_LEN - ROLLING_POINT_SPACING] + window[BUFFER_LEN - ROLLING_POINT_SPACING - 1];
+                int rrs = window[BUFFER_LEN - 1] + window[BUFFER_LEN - 1];
+                if (traced) {
+                    trace.tick = firstTick + start + ii;
+                }
+
+                if (rising && lrs > rrs && lrs > threshold) {
+                    if (traced) {
+                        trace.add(TRACE_PEAK, lrs);
+                    }
+                    updatePeakThreshold(lrs);
+                    threshold = peakThreshold;
+                    rising = false;
+                    counter = 0;
+                    peakOffsets[peaks++] = start + ii;
+                    continue;
+                }
+                if (!rising && counter > params.refractoryPeriod && lrs < rrs) {
+                    rising = true;
+                    if (traced) {
+                        trace.add(TRACE_REFRACTORY_EXIT, counter);
+                    }
+                } else if (counter > params.thresholdResetPeriod) {
+                    counter += 1;
+                    resetPeakThreshold();
+                    threshold = 0;
+                } else {
+                    counter += 1;
+                }
+            }
+            for (int ii = 0; ii < BUFFER_LEN; ii++) {
+                history[ii] = history[len + ii];
+            }
+        }
+        rising_edge = rising;
+        rp_counter = counter;
+        for (int ii = 0; ii < BUFFER_LEN; ii++) {
+            sb.addSample(history[ii]);
+        }
+        return peaks;
+    }
+
+    // the peak threshold state, saved across restarts by WarmStart.h
+    // copies the last PEAK_BUFFER_LEN peaks into peaks, oldest first
+    void getPeaks(int* peaks) {
+        for (int ii = 0; ii < PEAK_BUFFER_LEN; ii++) {
+            peaks[ii] = pb[BUFFER_LEN - PEAK_BUFFER_LEN + ii];
+        }
+    }
+
+    // replaces the peak buffer with peaks (oldest first), as if they had just been detected
+    void seedPeaks(const int* peaks) {
+        resetPeakThreshold();
+        for (int ii = 0; ii < PEAK_BUFFER_LEN; ii++) {
+            updatePeakThreshold(peaks[ii]);
+        }
+    }
+
     void updatePeakThreshold(const int newPeakVal) {
         peakSum += newPeakVal;
         peakSum -= pb[BUFFER_LEN - PEAK_BUFFER_LEN];
         pb.addSample(newPeakVal);
-        peakThreshold = peakSum / THRESHOLD_SCALE;
+        peakThreshold = peakSum / config.active().thresholdScale;
+        if (traced) {
+            trace.add(TRACE_THRESHOLD_UPDATE, peakThreshold);
+        }
     }
 
     void resetPeakThreshold() {
+        // called every sample until a peak is found, only the first reset is a state change
+        if (traced && peakThreshold != 0) {
+            trace.add(TRACE_THRESHOLD_RESET, 0);
+        }
         peakSum = 0;
         peakThreshold = 0;
         for(int ii=BUFFER_LEN - PEAK_BUFFER_LEN; ii<BUFFER_LEN; ii++) {
@@ -0,0 +1,194 @@
+/*
+ Detector and trigger parameters that can be changed over serial while the unit runs.
+
+ The parameters are double buffered: the sampling interrupt only reads the active
+ copy, and the main loop writes a change into the shadow copy and asks for a swap.
+ The interrupt swaps the copies at the start of the next sample, so a sample is
+ always processed with one complete, validated set of parameters.
+
+ Host commands (see handleLine), each answered with a line starting with "A":
+    SET <name> <value>  ->  A OK <name> <value>  or  A ERR <reason>
+    GET                 ->  A <name> <value> <name> <value> ...
+ set() never waits: a change made before the interrupt has picked up the previous
+ one is refused as "busy". The sketch waits up to CONFIG_SWAP_TIMEOUT for the swap
+ before handling a command, so several SETs sent at once are all applied.
+*/
+
+#ifndef __RUNTIMECONFIG__
+#define __RUNTIMECONFIG__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// defaults, in effect from power up until changed with SET
+// # of samples to wait before searching for peaks again, determines maximum possible BPM
+// should be kept as short as possible, because many problems arise when refractory period approaches beat period
+const int REFRACTORY_PERIOD = 40;
+const int THRESHOLD_RESET_PERIOD = 1250; // reset magnitude thresholds after 5 seconds without heartbeat
+const int THRESHOLD_SCALE = 7; // peak threshold is the sum of the last PEAK_BUFFER_LEN peaks divided by this
+// number of potentiomter codes to correct by if signal is out of range
+// a higher number results in a faster correction, at the risk of over-adjusting to short term amplitude spikes
+const int CORRECTION = 5;
+const int TRIGGER_PULSE_DURATION = 20; // milliseconds, given in the scanner's external triggering timing table
+const int TRIGGER_POLICY = 0; // TRIGGER_FIRE, see TriggerScheduler.h
+const int TRIGGER_HOLD_PERCENT = 12; // longest a held trigger may be delayed, in percent of the RR interval
+// milliseconds, scanner busy window for the simulated scanner (SIMULATED_SCANNER builds only), 0 is off
+const int SCANNER_BUSY = 0;
+
+const uint32_t CONFIG_SWAP_TIMEOUT = 20; // milliseconds, five samples; the interrupt swaps at the next sample
+const int RUNTIME_NAME_LEN = 32; // longer parameter names are unknown anyway
+const int RUNTIME_REPLY_LEN = 256; // long enough for the GET reply
+
+struct runtimeParams {
+    int thresholdScale;
+    int refractoryPeriod; // samples
+    int thresholdResetPeriod; // samples
+    int correction; // potentiometer codes
+    int pulseDuration; // milliseconds
+    int triggerPolicy;
+    int triggerHold; // percent of the RR interval
+    int scannerBusy; // milliseconds
+};
+
+struct runtimeParamInfo {
+    const char* name;
+    int runtimeParams::*field;
+    int min;
+    int max;
+};
+
+const runtimeParamInfo RUNTIME_PARAMS[] = {
+    {"threshold_scale", &runtimeParams::thresholdScale, 1, 50},
+    {"refractory_period", &runtimeParams::refractoryPeriod, 5, 250},
+    {"threshold_reset_period", &runtimeParams::thresholdResetPeriod, 250, 5000},
+    {"correction", &runtimeParams::correction, 1, 32},
+    {"pulse_duration", &runtimeParams::pulseDuration, 4, 100},
+    {"trigger_policy", &runtimeParams::triggerPolicy, 0, 2},
+    {"trigger_hold", &runtimeParams::triggerHold, 0, 50},
+    {"scanner_busy", &runtimeParams::scannerBusy, 0, 5000},
+};
+const int RUNTIME_PARAM_COUNT = sizeof(RUNTIME_PARAMS) / sizeof(RUNTIME_PARAMS[0]);
+
+class runtimeConfig {
+public:
+    runtimeConfig() {
+        runtimeParams defaults = {THRESHOLD_SCALE, REFRACTORY_PERIOD, THRESHOLD_RESET_PERIOD, CORRECTION,
+                                  TRIGGER_PULSE_DURATION, TRIGGER_POLICY, TRIGGER_HOLD_PERCENT, SCANNER_BUSY};
+        params[0] = defaults;
+        params[1] = defaults;
+    }
+private:
+    runtimeParams params[2];
+    volatile int activeIndex = 0;
+    volatile bool pendingSwap = false; // set by the main loop, cleared by the interrupt
+public:
+    // interrupt side
+    const runtimeParams& active() const {
+        return params[activeIndex];
+    }
+
+    // call at the start of every sample, before any parameter is read
+    void swap() {
+        if (pendingSwap) {
+            activeIndex ^= 1;
+            pendingSwap = false;
+        }
+    }
+
+    // main loop side
+    // true until the interrupt has swapped in the last change
+    bool swapPending() const {
+        return pendingSwap;
+    }
+
+    // (a host program without the interrupt calls swap() itself after set())
+    // sets one parameter and queues the change for the next swap; returns NULL, or the reason the value
+    // was refused, in which case nothing changes
+    const char* set(const char* name, const int value) {
+        const runtimeParamInfo* info = find(name);
+        if (info == NULL) {
+            return "unknown parameter";
+        }
+        if (value < info->min || value > info->max) {
+            return "out of range";
+        }
+        // the previous change hasn't been swapped in yet, writing the shadow copy now could be swapped in
+        // halfway through; the caller must not wait here, the interrupt may not be running
+        if (pendingSwap) {
+            return "busy";
+        }
+        runtimeParams& shadow = params[activeIndex ^ 1];
+        shadow = params[activeIndex];
+        shadow.*(info->field) = value;
+        if (shadow.thresholdResetPeriod <= shadow.refractoryPeriod) {
+            return "threshold_reset_period must be longer than refractory_period";
+        }
+        __sync_synchronize(); // the shadow copy must be complete before the interrupt can swap to it
+        pendingSwap = true;
+        return NULL;
+    }
+
+    int get(const int index) const {
+        return params[activeIndex].*(RUNTIME_PARAMS[index].field);
+    }
+
+    // handles a SET or GET command line (without the newline) and formats the "A ..." reply line into
+    // reply; returns false, leaving reply alone, if line is some other command
+    bool handleLine(const char* line, char* reply, const int replyLen) {
+        if (strcmp(line, "GET") == 0) {
+            int n = snprintf(reply, replyLen, "A");
+            for (int ii = 0; ii < RUNTIME_PARAM_COUNT && n < replyLen; ii++) {
+                n += snprintf(reply + n, replyLen - n, " %s %d", RUNTIME_PARAMS[ii].name, get(ii));
+            }
+            if (n < replyLen) {
+                snprintf(reply + n, replyLen - n, "\n");
+            }
+            return true;
+        }
+        if (strncmp(line, "SET ", 4) != 0) {
+            return false;
+        }
+        // "SET <name> <value>", the change takes effect from the next sample
+        const char* args = line + 4;
+        const char* space = strchr(args, ' ');
+        if (space == NULL || space - args >= RUNTIME_NAME_LEN) {
+            snprintf(reply, replyLen, "A ERR %s\n", space == NULL ? "expected SET <name> <value>" : "unknown parameter");
+            return true;
+        }
+        char name[RUNTIME_NAME_LEN];
+        strncpy(name, args, space - args);
+        name[space - args] = '\0';
+        char* end = NULL;
+        long value = strtol(space + 1, &end, 10);
+        const char* error = NULL;
+        if (end == space + 1 || *end != '\0') {
+            error = "value must be an integer";
+        } else if (value < -1000000 || value > 1000000) {
+            error = "out of range";
+        } else {
+            error = set(name, value);
+        }
+        if (error == NULL) {
+            snprintf(reply, replyLen, "A OK %s %ld\n", name, value);
+        } else {
+            snprintf(reply, replyLen, "A ERR %s\n", error);
+        }
+        return true;
+    }
+
+private:
+    static const runtimeParamInfo* find(const char* name) {
+        for (int ii = 0; ii < RUNTIME_PARAM_COUNT; ii++) {
+            if (strcmp(name, RUNTIME_PARAMS[ii].name) == 0) {
+                return &RUNTIME_PARAMS[ii];
+            }
+        }
+        return NULL;
+    }
+};
+
+runtimeConfig config;
+
+#endif
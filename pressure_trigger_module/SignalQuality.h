@@ -0,0 +1,150 @@
+#ifndef __SIGNALQUALITY__
+#define __SIGNALQUALITY__
+
+#include <stdint.h>
+
+// all levels are in 16 bit ADC counts
+const int SQI_SATURATION_LEVEL = 55000; // same as MAX_SIGNAL_AMPLITUDE in AutoGainAdjust.h
+const int SQI_FLAT_AMPLITUDE = 200; // ~15 mV, smaller pulses are no pulse at all, even at unity gain
+const int SQI_MAX_BEAT_LEN = 500; // 2 seconds, a segment this long without a beat is scored on its own
+const int SQI_AMPLITUDE_TOLERANCE = 4; // pulse amplitude may differ from the average by 1/4 of the average
+const int SQI_AMPLITUDE_SHIFT = 3; // each beat contributes 1/8 of the average pulse amplitude
+// slope sum peak as a percentage of the pulse amplitude, a clean upstroke falls inside this range
+const int SQI_SHAPE_MIN = 20;
+const int SQI_SHAPE_MAX = 150;
+// mean absolute second difference of the filtered signal, in 1/10000ths of the pulse amplitude
+const int SQI_NOISE_LIMIT = 100;
+
+const int SQI_TRIGGER_THRESHOLD = 40; // beats that score lower don't trigger the scanner
+
+// score deductions
+const int SQI_SATURATED_PENALTY = 30;
+const int SQI_AMPLITUDE_PENALTY = 25;
+const int SQI_SHAPE_PENALTY = 25;
+const int SQI_NOISY_PENALTY = 40;
+
+// flags, the reasons for a low score
+const uint8_t SQI_SATURATED = 1; // signal above SQI_SATURATION_LEVEL during the beat
+const uint8_t SQI_FLAT = 2; // no pulse, or no beat for SQI_MAX_BEAT_LEN samples
+const uint8_t SQI_AMPLITUDE = 4; // pulse amplitude inconsistent with the previous beats
+const uint8_t SQI_SHAPE = 8; // slope sum peak out of proportion with the pulse
+const uint8_t SQI_NOISY = 16; // high frequency noise
+// gain adjustment is paused while the signal has these flags, so it doesn't chase artifacts or a disconnected
+// sensor; never while saturated though, a railed input also reads as flat and reducing the gain is how it gets fixed
+const uint8_t SQI_FREEZE_GAIN = SQI_FLAT | SQI_NOISY;
+
+class signalQuality {
+// scores each beat from 0 (unusable) to 100 (clean) from the samples since the previous beat
+// the per-sample work is a few compares and adds, the score itself is computed once per beat
+public:
+    signalQuality() {}
+private:
+    int beatLen = 0;
+    int saturatedSamples = 0;
+    int minVal = 0;
+    int maxVal = 0;
+    int ssfPeak = 0;
+    uint32_t noiseSum = 0;
+    int x_n_1 = 0; // previous two filtered samples, for the second difference
+    int x_n_2 = 0;
+
+    int avgAmplitude = 0; // running average of the pulse amplitude of good beats
+    volatile int lastScore = 100;
+    volatile uint8_t lastFlags = 0;
+public:
+    // call for every sample, with the raw ADC value and the outputs of the filters
+    void step(const int raw, const int lpf, const int ssf) {
+        if (raw > SQI_SATURATION_LEVEL) {
+            saturatedSamples++;
+        }
+        if (beatLen == 0 || lpf < minVal) {
+            minVal = lpf;
+        }
+        if (beatLen == 0 || lpf > maxVal) {
+            maxVal = lpf;
+        }
+        if (ssf > ssfPeak) {
+            ssfPeak = ssf;
+        }
+        int d2 = lpf - 2 * x_n_1 + x_n_2;
+        noiseSum += d2 > 0 ? d2 : -d2;
+        x_n_2 = x_n_1;
+        x_n_1 = lpf;
+        beatLen++;
+
+        if (beatLen >= SQI_MAX_BEAT_LEN) {
+            evaluate(SQI_FLAT);
+        }
+    }
+
+    // call when a beat is detected, returns the beat's score
+    int beat() {
+        if (beatLen == 0) {
+            // step() has just scored this segment because it ran too long, the beat belongs to that score
+            return lastScore;
+        }
+        evaluate(0);
+        return lastScore;
+    }
+
+    int score() const {
+        return lastScore;
+    }
+
+    uint8_t flags() const {
+        return lastFlags;
+    }
+
+    bool freezeGain() const {
+        return (lastFlags & SQI_FREEZE_GAIN) && !(lastFlags & SQI_SATURATED);
+    }
+
+private:
+    void evaluate(uint8_t flags) {
+        int amplitude = maxVal - minVal;
+        int score = 100;
+
+        if (saturatedSamples > 0) {
+            flags |= SQI_SATURATED;
+            score -= SQI_SATURATED_PENALTY;
+        }
+        if (amplitude < SQI_FLAT_AMPLITUDE) {
+            flags |= SQI_FLAT;
+        }
+        if (!(flags & SQI_FLAT)) {
+            int deviation = amplitude - avgAmplitude;
+            if (avgAmplitude > 0 && (deviation > 0 ? deviation : -deviation) * SQI_AMPLITUDE_TOLERANCE > avgAmplitude) {
+                flags |= SQI_AMPLITUDE;
+                score -= SQI_AMPLITUDE_PENALTY;
+            }
+            int shape = (int)((int64_t)ssfPeak * 100 / amplitude);
+            if (shape < SQI_SHAPE_MIN || shape > SQI_SHAPE_MAX) {
+                flags |= SQI_SHAPE;
+                score -= SQI_SHAPE_PENALTY;
+            }
+            int noise = (int)((int64_t)noiseSum * 10000 / beatLen / amplitude);
+            if (noise > SQI_NOISE_LIMIT) {
+                flags |= SQI_NOISY;
+                score -= SQI_NOISY_PENALTY;
+            }
+            // a single artifact only moves the reference amplitude by 1/8 of its error
+            if (avgAmplitude == 0) {
+                avgAmplitude = amplitude;
+            } else {
+                avgAmplitude += (amplitude - avgAmplitude) >> SQI_AMPLITUDE_SHIFT;
+            }
+        }
+        if (flags & SQI_FLAT) {
+            score = 0;
+        }
+
+        lastScore = score > 0 ? score : 0;
+        lastFlags = flags;
+        beatLen = 0;
+        saturatedSamples = 0;
+        ssfPeak = 0;
+        noiseSum = 0;
+    }
+};
+
+#endif
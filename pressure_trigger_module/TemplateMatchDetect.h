@@ -0,0 +1,271 @@
+#ifndef __TEMPLATEMATCHDETECT__
+#define __TEMPLATEMATCHDETECT__
+
+#include <stdint.h>
+#include "PressurePeakDetect.h"
+
+// number of slope sum samples in the template, must be a power of two
+// 32 x 4ms = 128ms, long enough to cover the upstroke of a pulse at up to ~300 BPM
+const int TEMPLATE_LEN = 32;
+const int TEMPLATE_LEN_SHIFT = 5; // log2(TEMPLATE_LEN)
+const int TEMPLATE_LEARN_BEATS = 4; // beats found by peakDetect before the template is used
+const int TEMPLATE_UPDATE_SHIFT = 3; // each matched beat contributes 1/8 of the template
+const int TEMPLATE_INPUT_SHIFT = 4; // slope sum values are scaled down to keep the correlation within 64 bits
+const int TEMPLATE_INPUT_MAX = 32767;
+const int TEMPLATE_SCALE = 127; // largest magnitude of the zero-mean template
+// normalized correlation a window must reach to count as a beat, in 1/65536ths (0.8)
+const int CORRELATION_THRESHOLD = 52429;
+// windows with less energy than this are flat signal, and never match
+const int64_t MIN_WINDOW_ENERGY = 1 << 10;
+// a match needs at least 1/4 of the learned beats' energy (half their amplitude), correlation alone
+// ignores amplitude and would match a small bump of the right shape
+const int TEMPLATE_ENERGY_GATE_SHIFT = 2;
+// a matched beat only updates the template if peakDetect found a beat within this many samples of it,
+// so a match at the wrong point of the pulse can't teach the template to keep matching there
+const int TEMPLATE_CONFIRM_WINDOW = 5;
+// relearn from peakDetect after this many matches in a row that it didn't confirm
+const int TEMPLATE_MAX_UNCONFIRMED = 4;
+
+class templateMatchDetect {
+// matched filter beat detector, a drop-in replacement for peakDetect on the slope sum signal
+// keeps a running average of the last few beats' slope sum waveforms and reports a beat where the
+// normalized cross correlation with that template peaks above CORRELATION_THRESHOLD
+// until enough beats have been seen to build a template (and after THRESHOLD_RESET_PERIOD
+// without a match) the slope sum peakDetect is used instead
+public:
+    templateMatchDetect() : bootstrap(false) {
+        for (int ii = 0; ii < TEMPLATE_LEN; ii++) {
+            window[ii] = 0;
+            templateAvg[ii] = 0;
+            templateZeroMean[ii] = 0;
+        }
+    }
+private:
+    peakDetect bootstrap; // always fed, so it is ready whenever the template has to be relearned
+
+    int32_t window[TEMPLATE_LEN]; // most recent scaled input samples
+    int windowPos = 0; // index of the oldest sample in window
+    int32_t droppedSample = 0; // sample that slid out of the window on the last step
+    int64_t windowSum = 0;
+    int64_t windowSumSquares = 0;
+
+    int32_t candidate[TEMPLATE_LEN]; // window of the last match, oldest first, until peakDetect confirms it
+    int candidateAge = -1; // samples since the last match, -1 when there is no candidate
+    int bootstrapAge = TEMPLATE_CONFIRM_WINDOW + 1; // samples since peakDetect's last beat
+    int unconfirmed = 0; // matches in a row that peakDetect didn't confirm
+
+    int32_t templateAvg[TEMPLATE_LEN]; // running average of matched beats, in input units
+    int16_t templateZeroMean[TEMPLATE_LEN]; // normalized copy of templateAvg used for matching
+    int32_t templateSum = 0; // sum of templateZeroMean, not exactly zero due to rounding
+    int64_t templateEnergy = 0; // sum of templateZeroMean squared
+    int64_t beatEnergy = 0; // average window energy of the learned beats
+    int learnedBeats = 0;
+
+    int lastRho = 0; // normalized correlation of the previous sample
+    int64_t lastEnergy = 0; // window energy of the previous sample
+    int rp_counter = REFRACTORY_PERIOD + 1; // samples since the last reported beat, none at startup
+public:
+    bool isPeak(const int x) {
+        bool bootstrapPeak = bootstrap.isPeak(x);
+        int64_t correlation = slide(x);
+        bootstrapAge = bootstrapPeak ? 0 : (bootstrapAge <= TEMPLATE_CONFIRM_WINDOW ? bootstrapAge + 1 : bootstrapAge);
+
+        if (learnedBeats < TEMPLATE_LEARN_BEATS) {
+            // peakDetect's beats are reported while learning, but not within the refractory period of a beat
+            // the template reported just before it was relearned
+            bool peak = bootstrapPeak && rp_counter > config.active().refractoryPeriod;
+            if (bootstrapPeak) {
+                trace.add(TRACE_PEAK, x);
+                previousWindow(candidate);
+                learn(candidate);
+                if (learnedBeats == TEMPLATE_LEARN_BEATS) {
+                    trace.add(TRACE_TEMPLATE_LEARNED, learnedBeats);
+                }
+            }
+            if (peak) {
+                rp_counter = 0;
+            } else if (rp_counter <= config.active().thresholdResetPeriod) {
+                rp_counter++;
+            }
+            return peak;
+        }
+
+        // the beat is reported on the sample after the normalized correlation peaks
+        int64_t energy = 0;
+        int rho = normalize(correlation, energy);
+        bool peak = rp_counter > config.active().refractoryPeriod && lastRho >= CORRELATION_THRESHOLD && rho < lastRho &&
+                    lastEnergy >= beatEnergy >> TEMPLATE_ENERGY_GATE_SHIFT;
+        int peakRho = lastRho;
+        lastRho = rho;
+        lastEnergy = energy;
+
+        if (peak) {
+            trace.add(TRACE_PEAK, peakRho);
+            previousWindow(candidate);
+            candidateAge = 0;
+            rp_counter = 0;
+            lastRho = 0;
+        } else if (rp_counter > config.active().thresholdResetPeriod) {
+            // the beat shape has changed too much to match, start over from the slope sum detector
+            relearn();
+        } else {
+            rp_counter++;
+        }
+        if (candidateAge >= 0) {
+            confirm();
+        }
+        return peak;
+    }
+
+    // the template is relearned after a restart, only the slope sum detector's threshold is kept
+    void getPeaks(int* peaks) {
+        bootstrap.getPeaks(peaks);
+    }
+
+    void seedPeaks(const int* peaks) {
+        bootstrap.seedPeaks(peaks);
+    }
+
+private:
+    int64_t slide(const int x) {
+        // O(1) sliding update of the window's sum and energy, O(TEMPLATE_LEN) dot product with the template
+        int32_t scaled = x >> TEMPLATE_INPUT_SHIFT;
+        if (scaled > TEMPLATE_INPUT_MAX) {
+            scaled = TEMPLATE_INPUT_MAX;
+        } else if (scaled < 0) {
+            scaled = 0;
+        }
+        int32_t oldest = window[windowPos];
+        droppedSample = oldest;
+        windowSum += scaled - oldest;
+        windowSumSquares += (int64_t)scaled * scaled - (int64_t)oldest * oldest;
+        window[windowPos] = scaled;
+        windowPos = (windowPos + 1) & (TEMPLATE_LEN - 1);
+
+        if (learnedBeats < TEMPLATE_LEARN_BEATS) {
+            return 0;
+        }
+        int32_t dot = 0;
+        for (int ii = 0; ii < TEMPLATE_LEN; ii++) {
+            dot += templateZeroMean[ii] * window[(windowPos + ii) & (TEMPLATE_LEN - 1)];
+        }
+        // remove the window mean's contribution, which is non-zero only because of template rounding
+        return dot - ((windowSum * templateSum) >> TEMPLATE_LEN_SHIFT);
+    }
+
+    void confirm() {
+        // learns the last match once peakDetect has found the same beat, gives up on it after
+        // TEMPLATE_CONFIRM_WINDOW samples
+        if (bootstrapAge <= TEMPLATE_CONFIRM_WINDOW) {
+            learn(candidate);
+            candidateAge = -1;
+            unconfirmed = 0;
+        } else if (candidateAge >= TEMPLATE_CONFIRM_WINDOW) {
+            candidateAge = -1;
+            if (++unconfirmed >= TEMPLATE_MAX_UNCONFIRMED) {
+                // matching consistently somewhere peakDetect doesn't see a beat
+                relearn();
+            }
+        } else {
+            candidateAge++;
+        }
+    }
+
+    void relearn() {
+        // matching restarts from scratch once the template is learned again, nothing from the old one may
+        // carry over: a stale lastRho would report a beat on the first sample, inside the refractory period
+        learnedBeats = 0;
+        unconfirmed = 0;
+        candidateAge = -1;
+        rp_counter = 0;
+        lastRho = 0;
+        lastEnergy = 0;
+        trace.add(TRACE_TEMPLATE_RESET, 0);
+    }
+
+    int normalize(const int64_t correlation, int64_t& windowEnergy) {
+        // correlation / sqrt(window energy * template energy), in 1/65536ths
+        windowEnergy = windowSumSquares - ((windowSum * windowSum) >> TEMPLATE_LEN_SHIFT);
+        if (correlation <= 0) {
+            return 0;
+        }
+        if (windowEnergy < MIN_WINDOW_ENERGY) {
+            return 0;
+        }
+        return (int)((correlation << 16) / isqrt(windowEnergy * templateEnergy));
+    }
+
+    static int64_t isqrt(int64_t x) {
+        // bit by bit integer square root, a few hundred cycles without an FPU
+        int64_t root = 0;
+        int64_t bit = (int64_t)1 << 62;
+        while (bit > x) {
+            bit >>= 2;
+        }
+        while (bit != 0) {
+            if (x >= root + bit) {
+                x -= root + bit;
+                root = (root >> 1) + bit;
+            } else {
+                root >>= 1;
+            }
+            bit >>= 2;
+        }
+        return root > 0 ? root : 1;
+    }
+
+    void previousWindow(int32_t* copy) {
+        // the window as it was one sample ago, oldest first
+        // beats are reported one sample after the correlation peaks, so learning the previous window
+        // keeps the template aligned instead of drifting later by a sample every beat
+        for (int ii = 0; ii < TEMPLATE_LEN; ii++) {
+            copy[ii] = ii == 0 ? droppedSample : window[(windowPos + ii - 1) & (TEMPLATE_LEN - 1)];
+        }
+    }
+
+    void learn(const int32_t* beat) {
+        // add a beat's window to the template, runs once per beat
+        int32_t sum = 0;
+        int64_t beatSum = 0;
+        int64_t beatSumSquares = 0;
+        for (int ii = 0; ii < TEMPLATE_LEN; ii++) {
+            int32_t x = beat[ii];
+            beatSum += x;
+            beatSumSquares += (int64_t)x * x;
+            if (learnedBeats < TEMPLATE_LEARN_BEATS) {
+                // plain average of the first few beats
+                templateAvg[ii] += (x - templateAvg[ii]) / (learnedBeats + 1);
+            } else {
+                templateAvg[ii] += (x - templateAvg[ii]) >> TEMPLATE_UPDATE_SHIFT;
+            }
+            sum += templateAvg[ii];
+        }
+        int64_t energy = beatSumSquares - ((beatSum * beatSum) >> TEMPLATE_LEN_SHIFT);
+        if (learnedBeats < TEMPLATE_LEARN_BEATS) {
+            beatEnergy += (energy - beatEnergy) / (learnedBeats + 1);
+            learnedBeats++;
+        } else {
+            beatEnergy += (energy - beatEnergy) >> TEMPLATE_UPDATE_SHIFT;
+        }
+
+        int32_t mean = sum >> TEMPLATE_LEN_SHIFT;
+        int32_t peak = 1;
+        for (int ii = 0; ii < TEMPLATE_LEN; ii++) {
+            int32_t d = templateAvg[ii] - mean;
+            if (d > peak) {
+                peak = d;
+            } else if (-d > peak) {
+                peak = -d;
+            }
+        }
+        templateSum = 0;
+        templateEnergy = 0;
+        for (int ii = 0; ii < TEMPLATE_LEN; ii++) {
+            templateZeroMean[ii] = (templateAvg[ii] - mean) * TEMPLATE_SCALE / peak;
+            templateSum += templateZeroMean[ii];
+            templateEnergy += templateZeroMean[ii] * templateZeroMean[ii];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ Decides when a detected beat is sent to the scanner as a trigger pulse.
+
+ While the scanner is acquiring it ignores triggers, and a trigger that arrives just
+ after it becomes ready starts the acquisition at the wrong cardiac phase. The
+ scheduler knows whether the scanner is ready (from the optional scanner ready input,
+ and/or the scannerBusyModel below) and applies the trigger_policy runtime parameter:
+    TRIGGER_FIRE  every beat is sent, as before (triggers while busy are counted as wasted)
+    TRIGGER_HOLD  a beat that arrives while the scanner is busy is held, and sent as soon
+                  as the scanner is ready, if that is within trigger_hold percent of the
+                  mean RR interval; otherwise it is dropped
+    TRIGGER_DROP  beats that arrive while the scanner is busy are not sent
+*/
+
+#ifndef __TRIGGERSCHEDULER__
+#define __TRIGGERSCHEDULER__
+
+#include <stdint.h>
+
+#include "DetectorTrace.h"
+#include "RuntimeConfig.h"
+
+const int TRIGGER_FIRE = 0;
+const int TRIGGER_HOLD = 1;
+const int TRIGGER_DROP = 2;
+
+class scannerBusyModel {
+// stands in for the scanner ready input on the bench and in the simulator: the scanner is busy for
+// scanner_busy milliseconds after every trigger it accepts, 0 turns the model off
+// only compiled into the sketch with SIMULATED_SCANNER defined, so it can never hold back a real scanner's triggers
+public:
+    scannerBusyModel(const int samplePeriodMs) : samplePeriodMs(samplePeriodMs) {}
+private:
+    const int samplePeriodMs;
+    int busyCount = 0; // samples until ready
+public:
+    bool ready() const {
+        return busyCount == 0;
+    }
+
+    // call every sample, accepted is true when a trigger was sent while the scanner was ready
+    void step(const bool accepted) {
+        if (accepted) {
+            busyCount = config.active().scannerBusy / samplePeriodMs;
+        } else if (busyCount > 0) {
+            busyCount--;
+        }
+    }
+};
+
+class triggerScheduler {
+public:
+    triggerScheduler(const int samplePeriodMs) : samplePeriodMs(samplePeriodMs) {}
+private:
+    const int samplePeriodMs;
+    bool holding = false;
+    int heldSamples = 0; // samples since the held beat
+    int maxHoldSamples = 0;
+public:
+    // totals since startup
+    volatile uint32_t accepted = 0; // sent when the beat was detected, with the scanner ready
+    volatile uint32_t delayed = 0; // held, then sent when the scanner became ready
+    volatile uint32_t dropped = 0; // not sent
+    volatile uint32_t wasted = 0; // sent while the scanner was busy (TRIGGER_FIRE only)
+
+    // call every sample; beat is true when a beat was detected on this sample, meanRR is the mean RR
+    // interval in milliseconds (0 if not known yet, only needed on beats). Returns true when a trigger
+    // pulse should be sent
+    bool step(const bool beat, const bool scannerReady, const int meanRR) {
+        if (holding) {
+            heldSamples++;
+            if (beat || heldSamples > maxHoldSamples) {
+                // too late for the held beat's cardiac phase, or superseded by the next beat
+                holding = false;
+                dropped++;
+                trace.add(TRACE_TRIGGER_DROPPED, heldSamples);
+            } else if (scannerReady) {
+                holding = false;
+                delayed++;
+                trace.add(TRACE_TRIGGER_DELAYED, heldSamples);
+                return true;
+            }
+        }
+        if (!beat) {
+            return false;
+        }
+
+        if (scannerReady) {
+            accepted++;
+            return true;
+        }
+        int policy = config.active().triggerPolicy;
+        if (policy == TRIGGER_FIRE) {
+            wasted++;
+            return true;
+        }
+        if (policy == TRIGGER_HOLD && meanRR > 0) {
+            holding = true;
+            heldSamples = 0;
+            maxHoldSamples = meanRR * config.active().triggerHold / (100 * samplePeriodMs);
+            return false;
+        }
+        dropped++;
+        trace.add(TRACE_TRIGGER_DROPPED, 0);
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ Warm start: keeps the converged gain and peak threshold in EEPROM across restarts.
+
+ Without it every power up starts at unity gain with the gain seek state set to
+ increasing, and with a zero peak threshold, so the first seconds of triggers are
+ unreliable. Once the gain has settled the main loop saves the potentiometer code,
+ the gain pot channel and the last peaks, and setup() restores them if they are
+ valid for the current input selection.
+
+ EEPROM wear is limited three ways: nothing is saved before the gain has converged,
+ saves are at least WARM_START_SAVE_PERIOD apart and only happen when the state has
+ changed noticeably, and only the bytes that differ are written.
+
+ The EEPROM is accessed through a Storage class with
+    uint8_t read(int address)
+    void write(int address, uint8_t value)
+ so the same code runs against a mock on the host.
+*/
+
+#ifndef __WARMSTART__
+#define __WARMSTART__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "PressurePeakDetect.h"
+
+const uint32_t WARM_START_MAGIC = 0x314D5257; // "WRM1"
+const uint16_t WARM_START_VERSION = 1; // increment when warmStartState changes
+const int WARM_START_ADDRESS = 0;
+const uint32_t WARM_START_SAVE_PERIOD = 60000; // milliseconds
+const int WARM_START_PEAK_TOLERANCE = 4; // peaks within 1/4 of the saved average aren't worth a save
+const int WARM_START_MAX_POT_VALUE = 256;
+
+// stored as-is, the fields are laid out so there is no padding
+struct warmStartState {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t gainPot; // channel of the input the state was saved for, see setupGainAdjustment
+    uint8_t unused;
+    int32_t potentiometerValue;
+    int32_t peaks[PEAK_BUFFER_LEN]; // oldest first
+    uint32_t checksum; // of everything above
+};
+
+inline uint32_t warmStartChecksum(const warmStartState& state) {
+    // FNV-1a
+    const uint8_t* bytes = (const uint8_t*)&state;
+    uint32_t hash = 2166136261u;
+    for (size_t ii = 0; ii < offsetof(warmStartState, checksum); ii++) {
+        hash = (hash ^ bytes[ii]) * 16777619u;
+    }
+    return hash;
+}
+
+// reads the saved state, returns false if there is none or it can't be used with this gain pot channel
+template <class Storage>
+bool loadWarmStart(Storage& storage, const int gainPot, warmStartState& state) {
+    uint8_t* bytes = (uint8_t*)&state;
+    for (size_t ii = 0; ii < sizeof(state); ii++) {
+        bytes[ii] = storage.read(WARM_START_ADDRESS + ii);
+    }
+    if (state.magic != WARM_START_MAGIC || state.version != WARM_START_VERSION ||
+        state.checksum != warmStartChecksum(state)) {
+        return false;
+    }
+    if (state.gainPot != gainPot) {
+        // the input selection switch has moved since the state was saved
+        return false;
+    }
+    if (state.potentiometerValue < 0 || state.potentiometerValue > WARM_START_MAX_POT_VALUE) {
+        return false;
+    }
+    for (int ii = 0; ii < PEAK_BUFFER_LEN; ii++) {
+        if (state.peaks[ii] <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// writes state, only touching the bytes that changed; returns the number of bytes written
+template <class Storage>
+int saveWarmStart(Storage& storage, warmStartState& state) {
+    state.magic = WARM_START_MAGIC;
+    state.version = WARM_START_VERSION;
+    state.unused = 0;
+    state.checksum = warmStartChecksum(state);
+    const uint8_t* bytes = (const uint8_t*)&state;
+    int written = 0;
+    for (size_t ii = 0; ii < sizeof(state); ii++) {
+        if (storage.read(WARM_START_ADDRESS + ii) != bytes[ii]) {
+            storage.write(WARM_START_ADDRESS + ii, bytes[ii]);
+            written++;
+        }
+    }
+    return written;
+}
+
+// whether current differs enough from saved to be worth an EEPROM write
+inline bool warmStartChanged(const warmStartState& saved, const warmStartState& current) {
+    if (saved.gainPot != current.gainPot || saved.potentiometerValue != current.potentiometerValue) {
+        return true;
+    }
+    int64_t savedSum = 0;
+    int64_t currentSum = 0;
+    for (int ii = 0; ii < PEAK_BUFFER_LEN; ii++) {
+        savedSum += saved.peaks[ii];
+        currentSum += current.peaks[ii];
+    }
+    int64_t difference = currentSum - savedSum;
+    return (difference > 0 ? difference : -difference) * WARM_START_PEAK_TOLERANCE > savedSum;
+}
+
+#endif
@@ -1,17 +1,24 @@
 #include "IntervalTimer.h"
+#include <EEPROM.h>
 #include "PressurePeakDetect.h"
+#include "TemplateMatchDetect.h"
 #include "AutoGainAdjust.h"
+#include "BlackBoxRecorder.h"
+#include "SignalQuality.h"
+#include "BeatStatistics.h"
+#include "WarmStart.h"
+#include "TriggerScheduler.h"
 
 IntervalTimer sampletimer;
 
 // written for Teensy 3.1 running at 96 MHz
 
 const int SAMPLING_PERIOD = 4; // milliseconds
-const int TRIGGER_PULSE_DURATION = 20; // milliseconds, given in the scanner's external triggering timing table
 const int SCANNER_TRIGGER_PIN = 19;
+// optional, high when the scanner can accept a trigger; pulled up, so the scanner is always ready when unconnected
+const int SCANNER_READY_PIN = 20;
 const int LED_PIN = 18;
 
-const int PULSE_DURATION = TRIGGER_PULSE_DURATION / SAMPLING_PERIOD;
 const int GAIN_ADJUST_PERIOD = 100; // milliseconds
 volatile int gainAdjustDuration = GAIN_ADJUST_PERIOD / SAMPLING_PERIOD;
 volatile int pulseDurationCount;
@@ -22,16 +29,61 @@ volatile int ANALOG_INPUT_PIN; // set at startup depending on switch position
 volatile int serial_update_count = 0;
 const int SAMPLE_SEND_PERIOD = 3;
 volatile int sampleSendCount = 0;
+// set while the main loop is writing to the serial port, so the interrupt doesn't interleave its telemetry
+volatile bool telemetryPaused = false;
+
+// commands are newline terminated ASCII strings sent by the host
+const int COMMAND_BUFFER_LEN = 48;
+char commandBuffer[COMMAND_BUFFER_LEN];
+int commandLength = 0;
 
 lowPassFilter filt;
 slopeSumFilter ssf;
+// uncomment to detect beats by matching against a template of recent beats instead of by slope sum thresholds
+// #define TEMPLATE_MATCH_DETECTOR
+#ifdef TEMPLATE_MATCH_DETECTOR
+templateMatchDetect pd;
+#else
 peakDetect pd;
+#endif
+blackBoxRecorder recorder(SAMPLING_PERIOD * 1000);
+signalQuality quality;
+beatStatistics beatStats(SAMPLING_PERIOD);
+triggerScheduler scheduler(SAMPLING_PERIOD);
+// uncomment on bench units only: pretends the scanner is busy for scanner_busy ms after every trigger, which on a
+// unit connected to a real scanner would hold back or drop real triggers
+// #define SIMULATED_SCANNER
+#ifdef SIMULATED_SCANNER
+scannerBusyModel scannerModel(SAMPLING_PERIOD);
+#endif
+// set to true to only trigger on beats scoring at least SQI_TRIGGER_THRESHOLD
+// off until the signal quality thresholds have been calibrated on full rate recordings
+const bool QUALITY_GATED_TRIGGERS = false;
+// set to true to hold the gain while the signal quality index flags the signal as flat or noisy
+// off for the same reason; even when on, the gain is never held while it is still being increased, a weak
+// pulse at unity gain reads as flat and raising the gain is how it gets fixed
+const bool QUALITY_GATED_GAIN = false;
+
+// all EEPROM access for the warm start goes through here
+struct eepromStorage {
+    uint8_t read(const int address) {
+        return EEPROM.read(address);
+    }
+    void write(const int address, const uint8_t value) {
+        EEPROM.write(address, value);
+    }
+};
+eepromStorage eeprom;
+warmStartState savedState; // what is in the EEPROM, valid if haveSavedState
+bool haveSavedState = false;
+uint32_t lastWarmStartCheck = 0; // millis
 
 void setup() {
     Serial.begin(115200); // fastest stable BAUD rate (Hz)
     analogReadRes(16);  // the teensy has 16 bit ADCs
     pinMode(SCANNER_TRIGGER_PIN, OUTPUT);
     pinMode(LED_PIN, OUTPUT);
+    pinMode(SCANNER_READY_PIN, INPUT_PULLUP);
     pinMode(INPUT_SELECT_PIN, INPUT);
 
     bool analogInputSelect = digitalRead(INPUT_SELECT_PIN);
@@ -42,32 +94,151 @@ void setup() {
         ANALOG_INPUT_PIN = 15;
     }
 
+    setupGainAdjustment();
+    haveSavedState = loadWarmStart(eeprom, GAIN_POT, savedState);
+    if (haveSavedState) {
+        // continue from the gain and peak threshold of the last run, instead of relearning both
+        restoreGain(savedState.potentiometerValue);
+        int peaks[PEAK_BUFFER_LEN];
+        for (int ii = 0; ii < PEAK_BUFFER_LEN; ii++) {
+            peaks[ii] = savedState.peaks[ii];
+        }
+        pd.seedPeaks(peaks);
+    }
+    lastWarmStartCheck = millis();
+
     // hardware clock interrupt service routine calls the sample routine every x microseconds
+    // started last, so the gain pot and detector are set up before the first sample
     sampletimer.begin(sample, SAMPLING_PERIOD * 1000);
-    setupGainAdjustment();
 }
 
 void loop() {
+    // the sampling interrupt does all of the signal processing, the main loop only services host commands
+    while (Serial.available() > 0) {
+        char c = Serial.read();
+        if (c == '\n' || c == '\r') {
+            if (commandLength > 0) {
+                commandBuffer[commandLength] = '\0';
+                handleCommand(commandBuffer);
+            }
+            commandLength = 0;
+        } else if (commandLength < COMMAND_BUFFER_LEN - 1) {
+            commandBuffer[commandLength++] = c;
+        }
+    }
+    updateWarmStart();
+}
+
+void updateWarmStart() {
+    // saves the gain and peak threshold to EEPROM once they've converged, see WarmStart.h
+    if (millis() - lastWarmStartCheck < WARM_START_SAVE_PERIOD) {
+        return;
+    }
+    lastWarmStartCheck = millis();
+    warmStartState state;
+    int peaks[PEAK_BUFFER_LEN];
+    // take a consistent copy of the interrupt's state
+    noInterrupts();
+    bool converged = seekState == 0 && potentiometerValue == targetPotentiometerValue;
+    state.gainPot = GAIN_POT;
+    state.potentiometerValue = potentiometerValue;
+    pd.getPeaks(peaks);
+    interrupts();
 
+    bool peaksValid = true;
+    for (int ii = 0; ii < PEAK_BUFFER_LEN; ii++) {
+        state.peaks[ii] = peaks[ii];
+        peaksValid = peaksValid && peaks[ii] > 0;
+    }
+    if (converged && peaksValid && (!haveSavedState || warmStartChanged(savedState, state))) {
+        saveWarmStart(eeprom, state);
+        savedState = state;
+        haveSavedState = true;
+    }
+}
+
+void handleCommand(const char* command) {
+    if (strcmp(command, "DUMP") == 0) {
+        // stream the black box contents, the host finds the start of the dump by its magic number
+        telemetryPaused = true;
+        recorder.dump(Serial);
+        Serial.send_now();
+        telemetryPaused = false;
+    } else if (strcmp(command, "TRACE") == 0) {
+        // stream the detector state transitions recorded since the last TRACE command
+        telemetryPaused = true;
+        trace.dump(Serial);
+        Serial.send_now();
+        telemetryPaused = false;
+    } else {
+        // SET and GET, see RuntimeConfig.h
+        // commands sent together are all handled before the next sample, so wait for the interrupt to swap in
+        // the previous change rather than refusing this one
+        uint32_t start = millis();
+        while (config.swapPending() && millis() - start < CONFIG_SWAP_TIMEOUT) {
+        }
+        char reply[RUNTIME_REPLY_LEN];
+        if (config.handleLine(command, reply, sizeof(reply))) {
+            telemetryPaused = true;
+            Serial.print(reply);
+            telemetryPaused = false;
+        }
+    }
 }
 
 void sample() {
     // signal pathway
     // blood pressure transducer --> Arduino ADC --> low pass filter --> slopesum function --> peak detector
+    config.swap(); // pick up parameter changes at a sample boundary
     int sampleVal = analogRead(ANALOG_INPUT_PIN);
+    recorder.addSample(sampleVal);
+    trace.tick = recorder.lastSampleIndex();
     int lpfVal = filt.step(sampleVal);
     int ssfVal = ssf.step(lpfVal);
     bool sampleIsPeak = pd.isPeak(ssfVal);
+    quality.step(sampleVal, lpfVal, ssfVal);
+    beatStats.step(sampleVal);
 
-    if(sampleIsPeak) {
+    if (sampleIsPeak) {
+        int beatScore = quality.beat();
+        trace.add(TRACE_BEAT_QUALITY, beatScore | (quality.flags() << 8));
+        if (!telemetryPaused) {
+            // tagged line, the plotting program skips it
+            Serial.printf("Q %d %d\n", beatScore, quality.flags());
+        }
+        beatRecord b;
+        if (beatStats.beat(beatScore >= SQI_TRIGGER_THRESHOLD, b) && !telemetryPaused) {
+            Serial.printf("B %d %d %d %d %d %d %d\n", b.rr, b.hr, b.hrSmoothed, b.systolic, b.diastolic, b.rrMean,
+                          b.rrVariance);
+        }
+        if (QUALITY_GATED_TRIGGERS && beatScore < SQI_TRIGGER_THRESHOLD) {
+            sampleIsPeak = false;
+        }
+    }
+
+    bool scannerReady = digitalRead(SCANNER_READY_PIN) == HIGH;
+#ifdef SIMULATED_SCANNER
+    scannerReady = scannerReady && scannerModel.ready();
+#endif
+    bool sendTrigger = scheduler.step(sampleIsPeak, scannerReady, sampleIsPeak ? beatStats.meanRR() : 0);
+#ifdef SIMULATED_SCANNER
+    scannerModel.step(sendTrigger && scannerReady);
+#endif
+    if (sampleIsPeak && !telemetryPaused) {
+        Serial.printf("S %lu %lu %lu %lu\n", (unsigned long)scheduler.accepted, (unsigned long)scheduler.delayed,
+                      (unsigned long)scheduler.dropped, (unsigned long)scheduler.wasted);
+    }
+
+    if(sendTrigger) {
         // when a peak is detected, sent a TTL pulse to the scanner
         digitalWrite(SCANNER_TRIGGER_PIN, HIGH);
         digitalWrite(LED_PIN, HIGH);
         triggerPulseHigh = true;
         pulseDurationCount = 0;
+        recorder.addEvent(BLACKBOX_TRIGGER, 0);
     }
 
-    if (triggerPulseHigh && pulseDurationCount >= PULSE_DURATION) {
+    if (triggerPulseHigh && pulseDurationCount * SAMPLING_PERIOD >= config.active().pulseDuration) {
         // keep the TTL pulse at logic high (3.3V) until pulse duration exceeded 
         digitalWrite(SCANNER_TRIGGER_PIN, LOW);
         digitalWrite(LED_PIN, LOW);
@@ -77,8 +248,15 @@ void sample() {
     } else {
     }
 
-    if (gainAdjustCount >= gainAdjustDuration) {
+    if (gainAdjustCount >= gainAdjustDuration && QUALITY_GATED_GAIN && seekState != 1 && quality.freezeGain()) {
+        // hold the gain until the signal is back
+        gainAdjustCount = 0;
+    } else if (gainAdjustCount >= gainAdjustDuration) {
+        int lastPotentiometerValue = potentiometerValue;
         adjustGain(sampleVal);
+        if (potentiometerValue != lastPotentiometerValue) {
+            recorder.addEvent(BLACKBOX_GAIN, potentiometerValue);
+        }
         gainAdjustCount = 0;
     } else {
         gainAdjustCount++;
@@ -86,7 +264,7 @@ void sample() {
     // send data to the plotting/logging program
     if (sampleSendCount < SAMPLE_SEND_PERIOD) {
         sampleSendCount += 1;
-    } else {
+    } else if (!telemetryPaused) {
         Serial.printf("%d %d\n", sampleVal, triggerPulseHigh);
         sampleSendCount = 0;
     }